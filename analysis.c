@@ -0,0 +1,163 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// analysis.c
+// ==========
+//
+// Lock-free buffer of recent audio for the spectrum analyzer, in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// The audio thread announces how far it is about to write, appends the
+// block to a ring and then publishes the total number of frames
+// written. The UI thread copies the latest frames out of the ring and
+// checks the announced position afterwards: if the writer may have
+// gone around the ring over them in the meantime the copy is torn and
+// it tries again. The writer never waits for the reader, so the audio
+// thread can not be blocked by the analyzer.
+//
+// The writer also tells which blocks are silent. Once the whole ring
+// is silent it stops copying zeros over zeros, and the reader can
+// skip its analysis altogether, see analysis_silent().
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Must be a power of two
+#define ANALYSIS_SIZE (1<<15)
+// Frames the spectrum analyzer transforms, a power of two for the FFT
+// and at most ANALYSIS_SIZE
+#define ANALYSIS_WINDOW (1<<7)
+
+// How many times analysis_read() retries a torn copy
+#define ANALYSIS_RETRIES 4
+
+typedef struct {
+  uint64_t claimed;                // [written] after the block being written
+  uint64_t written;                // total frames ever written
+  uint64_t audible;                // [written] after the last audible block
+  float samples[ANALYSIS_SIZE];
+} Analysis;
+
+void analysis_init(Analysis* analysis)
+{
+  memset(analysis, 0, sizeof(*analysis));
+  return;
+}
+
+// Copy [frame_count] frames of [channels] interleaved samples of
+// [input] to [output], mixed down to one channel
+static void analysis_downmix(float* restrict output, const float* restrict input,
+                             unsigned int frame_count, unsigned int channels)
+{
+  if (channels == 1)
+  {
+    memcpy(output, input, frame_count * sizeof(float));
+    return;
+  }
+  const float scale = 1.0f / channels;
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    float sum = 0.0f;
+    for (unsigned int c = 0; c < channels; ++c)
+      sum += input[i * channels + c];
+    output[i] = sum * scale;
+  }
+  return;
+}
+
+// Audio thread only. Appends [frame_count] frames of [channels]
+// interleaved samples of [input], mixed down to one channel, or of
+// silence if [silent].
+void analysis_write(Analysis* analysis, const float* input,
+                    unsigned int frame_count, unsigned int channels,
+                    bool silent)
+{
+  // The ring holds zeros already
+  if (silent && analysis->written - analysis->audible >= ANALYSIS_SIZE)
+  {
+    __atomic_store_n(&analysis->claimed, analysis->written + frame_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&analysis->written, analysis->written + frame_count, __ATOMIC_RELEASE);
+    return;
+  }
+
+  uint64_t written = analysis->written;
+  unsigned int start = written & (ANALYSIS_SIZE - 1);
+
+  // Only the last ANALYSIS_SIZE frames of a huge block can be kept
+  if (frame_count > ANALYSIS_SIZE)
+  {
+    input += (frame_count - ANALYSIS_SIZE) * channels;
+    written += frame_count - ANALYSIS_SIZE;
+    start = written & (ANALYSIS_SIZE - 1);
+    frame_count = ANALYSIS_SIZE;
+  }
+
+  __atomic_store_n(&analysis->claimed, written + frame_count, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  unsigned int first = ANALYSIS_SIZE - start;
+  if (first > frame_count) first = frame_count;
+  if (silent)
+  {
+    memset(analysis->samples + start, 0, first * sizeof(float));
+    memset(analysis->samples, 0, (frame_count - first) * sizeof(float));
+  }
+  else
+  {
+    analysis_downmix(analysis->samples + start, input, first, channels);
+    analysis_downmix(analysis->samples, input + first * channels,
+                     frame_count - first, channels);
+    __atomic_store_n(&analysis->audible, written + frame_count, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&analysis->written, written + frame_count, __ATOMIC_RELEASE);
+  return;
+}
+
+// Any thread. Copies the latest [frame_count] contiguous frames to
+// [output], oldest first. Frames never written, or older than the
+// ring, read as silence.
+// Returns false if every attempt was torn by the writer, in which
+// case [output] holds the last attempt.
+bool analysis_read(const Analysis* analysis, float* output,
+                   unsigned int frame_count)
+{
+  if (frame_count > ANALYSIS_SIZE)
+  {
+    memset(output, 0, (frame_count - ANALYSIS_SIZE) * sizeof(float));
+    output += frame_count - ANALYSIS_SIZE;
+    frame_count = ANALYSIS_SIZE;
+  }
+
+  for (unsigned int attempt = 0; attempt < ANALYSIS_RETRIES; ++attempt)
+  {
+    uint64_t end = __atomic_load_n(&analysis->written, __ATOMIC_ACQUIRE);
+    uint64_t begin = (end > frame_count) ? end - frame_count : 0;
+    unsigned int missing = frame_count - (unsigned int)(end - begin);
+    memset(output, 0, missing * sizeof(float));
+
+    for (uint64_t i = begin; i < end; ++i)
+      output[missing + (i - begin)] = analysis->samples[i & (ANALYSIS_SIZE - 1)];
+
+    // The copy is good if the writer did not start overwriting [begin]
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t claimed = __atomic_load_n(&analysis->claimed, __ATOMIC_RELAXED);
+    if (claimed - begin <= ANALYSIS_SIZE)
+      return true;
+  }
+  return false;
+}
+
+// Any thread. Returns true if the latest [frame_count] frames are all
+// silent, so analysis_read() would return only zeros.
+bool analysis_silent(const Analysis* analysis, unsigned int frame_count)
+{
+  uint64_t written = __atomic_load_n(&analysis->written, __ATOMIC_ACQUIRE);
+  uint64_t audible = __atomic_load_n(&analysis->audible, __ATOMIC_RELAXED);
+  return written >= audible && written - audible >= frame_count;
+}
@@ -0,0 +1,1323 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// bench.c
+// =======
+//
+// Benchmarks for the minipiano synthesis code.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// Usage
+// -----
+//
+//     make bench
+//     make bench BENCH_FLAGS=--json > bench.json
+//
+// Every kernel is timed over BENCH_RUNS runs of the same amount of
+// work, after one run to warm up the caches. Results report the
+// median and the 99th percentile of the runs, in nanoseconds per
+// sample for the synthesis kernels and per transform for the FFTs,
+// and the realtime factor, that is how many seconds of audio are
+// rendered in one second of CPU time on a single core.
+//
+// With --json the results are printed as one JSON object instead of
+// text, to compare them across commits.
+//
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+// Thread affinity of the workers
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "simd.c"
+#include "tuning.c"
+#include "wavetable.c"
+#include "waveguide.c"
+#include "synth.c"
+#include "workers.c"
+#include "fft.c"
+#include "convolver.c"
+#include "fdn.c"
+
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_BLOCK_SIZE  512
+// Timed runs per measurement, and frames rendered in each run
+#define BENCH_RUNS        200
+#define BENCH_RUN_FRAMES  4096
+// Limits of the correctness checks, see bench_check()
+#define BENCH_SINE_ERROR_DB  -100.0  // sine kernels against sin()
+#define BENCH_ALIAS_GAIN_DB  10.0    // PolyBLEP at least this far below naive
+#define BENCH_FFT_ERROR      1e-5    // FFTs against a double DFT, of the peak
+#define BENCH_DFT_ERROR      1e-3    // dft() too, it accumulates in float
+#define BENCH_RENDER_ERROR   1e-5    // other renderers against synth_render()
+#define BENCH_REVERB_ERROR   1e-4    // convolver against a double convolution
+
+static double bench_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//
+// Statistics and reports
+//
+
+typedef struct {
+  double median;
+  double p99;
+} BenchStats;
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+// Sorts the [runs] durations of [times], in seconds, and returns their
+// median and 99th percentile in nanoseconds per unit of work, with
+// [units] done by each run
+static BenchStats bench_stats(double* times, unsigned int runs, double units)
+{
+  qsort(times, runs, sizeof(double), compare_double);
+  unsigned int p99 = (runs * 99 + 99) / 100 - 1;
+  return (BenchStats) {
+    .median = times[runs / 2] * 1e9 / units,
+    .p99    = times[p99] * 1e9 / units,
+  };
+}
+
+// Realtime factor of a kernel taking [ns] per frame
+static double bench_realtime(double ns)
+{
+  return 1e9 / (ns * BENCH_SAMPLE_RATE);
+}
+
+// What a result measures. Parameters that do not apply are 0.
+typedef struct {
+  const char*  group;
+  const char*  name;
+  const char*  variant;
+  unsigned int block;
+  unsigned int voices;
+  unsigned int size;
+} BenchCase;
+
+typedef struct {
+  const char* key;
+  double      value;
+} BenchMetric;
+
+static bool bench_json = false;
+static unsigned int bench_result_count = 0;
+static const char* bench_group = NULL;
+
+static void bench_begin(void)
+{
+  if (bench_json)
+    printf("{\"sample_rate\": %d, \"simd\": \"%s\", \"runs\": %d, \"results\": [",
+           BENCH_SAMPLE_RATE, sine_block_name, BENCH_RUNS);
+  else
+    printf("%d Hz, %s kernels, median and p99 of %d runs\n",
+           BENCH_SAMPLE_RATE, sine_block_name, BENCH_RUNS);
+  return;
+}
+
+static void bench_end(void)
+{
+  if (bench_json)
+    printf("\n]}\n");
+  return;
+}
+
+// Print one result with its [metric_count] metrics
+static void bench_report(BenchCase c, unsigned int metric_count,
+                         const BenchMetric* metrics)
+{
+  if (bench_json)
+  {
+    printf("%s\n  {\"group\": \"%s\", \"name\": \"%s\", \"variant\": \"%s\", "
+           "\"block\": %u, \"voices\": %u, \"size\": %u",
+           bench_result_count ? "," : "", c.group, c.name, c.variant,
+           c.block, c.voices, c.size);
+    for (unsigned int i = 0; i < metric_count; ++i)
+      printf(", \"%s\": %.6g", metrics[i].key, metrics[i].value);
+    printf("}");
+  }
+  else
+  {
+    if (!bench_group || strcmp(bench_group, c.group) != 0)
+      printf("%s\n", c.group);
+    printf("  %-9s %-10s", c.name, c.variant);
+    if (c.block)  printf(" block %4u", c.block);
+    if (c.voices) printf(" voices %2u", c.voices);
+    if (c.size)   printf(" size %5u", c.size);
+    for (unsigned int i = 0; i < metric_count; ++i)
+      printf("  %s %.4g", metrics[i].key, metrics[i].value);
+    printf("\n");
+  }
+  bench_group = c.group;
+  ++bench_result_count;
+  fflush(stdout);
+  return;
+}
+
+// Correctness checks that failed, make bench exits with an error if any
+static unsigned int bench_failures = 0;
+
+// Fail the run unless [value] of [metric] for [c] is at most [limit]
+static void bench_check(BenchCase c, const char* metric, double value, double limit)
+{
+  if (value <= limit)
+    return;
+  fprintf(stderr, "FAIL %s %s %s size %u: %s %.4g above %.4g\n",
+          c.group, c.name, c.variant, c.size, metric, value, limit);
+  ++bench_failures;
+  return;
+}
+
+// Report [stats] of a kernel taking time per frame, with its
+// realtime factor
+static void bench_report_frames(BenchCase c, BenchStats stats)
+{
+  bench_report(c, 3, (BenchMetric[]) {
+      { "median_ns", stats.median },
+      { "p99_ns",    stats.p99 },
+      { "realtime",  bench_realtime(stats.median) },
+    });
+  return;
+}
+
+//
+// Synthesis
+//
+
+// Per-sample oscillator with the instrument switch inside the frame
+// loop, as data_callback used to do before the block kernels
+static float legacy_phase = 0.0f;
+
+__attribute__((noinline))
+static void legacy_oscillator(Instrument instrument, float increment,
+                              float* output)
+{
+  switch(instrument)
+  {
+  case SINE:
+    *output = sin(legacy_phase * 2 * SYNTH_PI);
+    break;
+  case SQUARE:
+    *output = (legacy_phase < 0.5f) ? 1.0f : -1.0f;
+    break;
+  case TRIANGLE:
+    *output = 4.0f * fabsf(legacy_phase - 0.5f) - 1.0f;
+    break;
+  default:
+    *output = 2.0f * legacy_phase - 1.0f;
+    break;
+  }
+  legacy_phase += increment;
+  if (legacy_phase >= 1.0f) legacy_phase -= 1.0f;
+}
+
+// Time one oscillator of [instrument] rendered in blocks of
+// [block_size], per sample. Mode -1 is the per-sample oscillator,
+// otherwise an OscillatorMode.
+static BenchStats bench_oscillator(Instrument instrument, unsigned int block_size,
+                                   int mode)
+{
+  static Synth synth;
+  static float block[BENCH_RUN_FRAMES];
+  static double times[BENCH_RUNS];
+  Oscillator osc = { 0, phase_increment(440.0, BENCH_SAMPLE_RATE) };
+  synth_init(&synth, BENCH_SAMPLE_RATE);
+  if (mode >= 0) synth.mode = mode;
+
+  unsigned int blocks = BENCH_RUN_FRAMES / block_size;
+  for (int run = -1; run < BENCH_RUNS; ++run)
+  {
+    double start = bench_now();
+    for (unsigned int b = 0; b < blocks; ++b)
+    {
+      if (mode < 0)
+      {
+        for (unsigned int i = 0; i < block_size; ++i)
+          legacy_oscillator(instrument, 440.0f / BENCH_SAMPLE_RATE, &block[i]);
+      }
+      else
+      {
+        synth_oscillator(&synth, instrument, block, block_size, &osc);
+      }
+    }
+    if (run >= 0) times[run] = bench_now() - start;
+  }
+  return bench_stats(times, BENCH_RUNS, blocks * block_size);
+}
+
+// Reference sine block with libm, as render_sine used to do
+static void sine_block_libm(float* restrict output, unsigned int frame_count,
+                            uint32_t phase, uint32_t increment)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+    output[i] = sinf(phase_to_float(phase + i * increment) * (float)(2 * SYNTH_PI));
+}
+
+// Maximum error of [kernel] against sin() over a sweep of phases, in dB
+static double bench_sine_error(SineKernel kernel)
+{
+  static float block[4096];
+  double max_error = 0.0;
+  for (unsigned int b = 0; b < 256; ++b)
+  {
+    uint32_t phase = b << 24;
+    uint32_t increment = 0xFFFFFFFFu / 4093;
+    kernel(block, 4096, phase, increment);
+    for (unsigned int i = 0; i < 4096; ++i)
+    {
+      uint32_t p = phase + i * increment;
+      double error = fabs(block[i] - sin(2 * SYNTH_PI * p * 0x1p-32));
+      if (error > max_error) max_error = error;
+    }
+  }
+  return 20 * log10(max_error);
+}
+
+// Time [kernel] in blocks of BENCH_BLOCK_SIZE, per sample
+static BenchStats bench_sine_kernel(SineKernel kernel)
+{
+  static float block[BENCH_BLOCK_SIZE];
+  static double times[BENCH_RUNS];
+  Oscillator osc = { 0, phase_increment(440.0, BENCH_SAMPLE_RATE) };
+
+  unsigned int blocks = BENCH_RUN_FRAMES / BENCH_BLOCK_SIZE;
+  for (int run = -1; run < BENCH_RUNS; ++run)
+  {
+    double start = bench_now();
+    for (unsigned int b = 0; b < blocks; ++b)
+    {
+      kernel(block, BENCH_BLOCK_SIZE, osc.phase, osc.increment);
+      osc.phase += BENCH_BLOCK_SIZE * osc.increment;
+    }
+    if (run >= 0) times[run] = bench_now() - start;
+  }
+  return bench_stats(times, BENCH_RUNS, blocks * BENCH_BLOCK_SIZE);
+}
+
+// Hours of audio rendered by bench_drift()
+#define BENCH_DRIFT_HOURS 4
+
+typedef struct {
+  double frames;
+  double pitch_cents;        // error of the quantized increment
+  double phase_error;        // fixed point phase against frames * increment, in turns
+  double float_phase_error;  // float accumulator against the exact phase, in turns
+  double output_db;          // last block against sin() of the exact phase
+} BenchDrift;
+
+// Hold A4 for BENCH_DRIFT_HOURS through synth_render() and compare
+// the phase it reaches with the exact one. A fixed point accumulator
+// wraps without rounding, so after any number of frames its phase is
+// exactly frames * increment modulo 2^32 and the pitch never drifts
+// from that of the increment. The float accumulator it replaced is
+// emulated on the same blocks for comparison.
+static BenchDrift bench_drift(void)
+{
+  static Synth synth;
+  static float block[BENCH_BLOCK_SIZE];
+  synth_init(&synth, BENCH_SAMPLE_RATE);
+  synth.mode = OSCILLATOR_ANALYTIC;
+  synth_note_on(&synth, 69, SINE, 1.0f, 0.0f);
+  const uint32_t increment = synth.increment[0];
+  const float float_increment = 440.0f / BENCH_SAMPLE_RATE;
+
+  const uint64_t frames = (uint64_t) BENCH_DRIFT_HOURS * 3600 * BENCH_SAMPLE_RATE;
+  float float_phase = 0.0f;
+  for (uint64_t frame = 0; frame < frames; frame += BENCH_BLOCK_SIZE)
+  {
+    synth_render(&synth, block, BENCH_BLOCK_SIZE);
+    float_phase += BENCH_BLOCK_SIZE * float_increment;
+    float_phase -= (float)(int) float_phase;
+  }
+
+  // 440 / 48000 = 11 / 1200 turns per frame
+  uint64_t ticks = (uint64_t) increment * frames;
+  double exact = (double)(frames * 11 % 1200) / 1200;
+  double float_error = fabs(float_phase - exact);
+  BenchDrift drift = {
+    .frames = (double) frames,
+    .pitch_cents = 1200 * log2(increment * 0x1p-32 * BENCH_SAMPLE_RATE / 440.0),
+    .phase_error = (double)(int32_t)(synth.phase[0] - (uint32_t) ticks) * 0x1p-32,
+    .float_phase_error = fmin(float_error, 1 - float_error),
+  };
+
+  // The voice is in sustain, so the last block is a sine at a fixed gain
+  double gain = synth.master * synth.envelopes[SINE].sustain;
+  double max_error = 0.0;
+  synth_render(&synth, block, BENCH_BLOCK_SIZE);
+  for (unsigned int i = 0; i < BENCH_BLOCK_SIZE; ++i)
+  {
+    uint32_t p = (uint32_t) ticks + i * increment;
+    double error = fabs(block[i] - gain * sin(2 * SYNTH_PI * p * 0x1p-32));
+    if (error > max_error) max_error = error;
+  }
+  drift.output_db = 20 * log10(max_error / gain);
+  return drift;
+}
+
+// Time synth_render() with [voice_count] held voices of [instrument]
+// using oscillator [mode], in blocks of [block_size] frames of
+// [channels] channels, per frame of the mix. Voices are panned
+// evenly from the first channel to the last one. With
+// [voice_parallel] sine voices are rendered in packs. With a [pool]
+// its workers share the voices with this thread. Strings are struck
+// again before every run so that none of them dies out.
+static BenchStats bench_voices(OscillatorMode mode, Instrument instrument,
+                               unsigned int voice_count, unsigned int block_size,
+                               unsigned int channels, bool voice_parallel,
+                               WorkerPool* pool)
+{
+  static Synth synth;
+  static float block[BENCH_RUN_FRAMES * SYNTH_CHANNELS_MAX];
+  static double times[BENCH_RUNS];
+
+  synth_init(&synth, BENCH_SAMPLE_RATE);
+  synth_set_channels(&synth, channels);
+  synth.master = 0.1f;
+  synth.mode = mode;
+  synth.voice_parallel = voice_parallel;
+  for (unsigned int v = 0; v < voice_count; ++v)
+  {
+    float pan = (voice_count > 1) ? 2.0f * v / (voice_count - 1) - 1.0f : 0.0f;
+    synth_note_on(&synth, 45 + v, instrument, 1.0f, pan);   // from A2, 110 Hz
+  }
+
+  unsigned int blocks = BENCH_RUN_FRAMES / block_size;
+  for (int run = -1; run < BENCH_RUNS; ++run)
+  {
+    for (unsigned int v = 0; v < voice_count && !instrument_oscillator(instrument); ++v)
+      synth_note_on(&synth, 45 + v, instrument, 1.0f, synth.pan[v]);
+    double start = bench_now();
+    for (unsigned int b = 0; b < blocks; ++b)
+      worker_pool_render(pool, &synth, block, block_size);
+    if (run >= 0) times[run] = bench_now() - start;
+  }
+  return bench_stats(times, BENCH_RUNS, blocks * block_size);
+}
+
+// Frames rendered by bench_render_error(), in blocks of up to
+// BENCH_RENDER_BLOCK_MAX frames
+#define BENCH_RENDER_FRAMES    (BENCH_SAMPLE_RATE * 2)
+#define BENCH_RENDER_BLOCK_MAX 2500
+
+// Largest difference between [voice_count] voices rendered with
+// synth_render() and the same voices rendered with [voice_parallel]
+// through [pool], in [channels] channels. Voice v plays
+// [instruments][v % instrument_count] and every other voice is
+// released halfway, so that envelopes change segment inside the
+// blocks. The blocks vary in size, most are not multiples of
+// SYNTH_BLOCK_SIZE and the longest take more than one job of the
+// workers, WORKER_FRAMES_MAX frames.
+static double bench_render_error(const Instrument* instruments,
+                                 unsigned int instrument_count,
+                                 unsigned int voice_count, unsigned int channels,
+                                 bool voice_parallel, WorkerPool* pool)
+{
+  static const unsigned int sizes[] = { 1, 37, 128, 300, 512, 1000, BENCH_RENDER_BLOCK_MAX };
+  static Synth reference, synth;
+  static float expected[BENCH_RENDER_BLOCK_MAX * SYNTH_CHANNELS_MAX];
+  static float output[BENCH_RENDER_BLOCK_MAX * SYNTH_CHANNELS_MAX];
+
+  Synth* synths[2] = { &reference, &synth };
+  for (unsigned int s = 0; s < 2; ++s)
+  {
+    synth_init(synths[s], BENCH_SAMPLE_RATE);
+    synth_set_channels(synths[s], channels);
+    synths[s]->master = 0.1f;
+    synths[s]->mode = OSCILLATOR_ANALYTIC;
+    for (unsigned int v = 0; v < voice_count; ++v)
+    {
+      float pan = (voice_count > 1) ? 2.0f * v / (voice_count - 1) - 1.0f : 0.0f;
+      synth_note_on(synths[s], 45 + v, instruments[v % instrument_count], 1.0f, pan);
+    }
+  }
+  synth.voice_parallel = voice_parallel;
+
+  double max_error = 0.0;
+  bool released = false;
+  unsigned int frames = 0;
+  for (unsigned int b = 0; frames < BENCH_RENDER_FRAMES; ++b)
+  {
+    if (!released && frames >= BENCH_RENDER_FRAMES / 2)
+    {
+      for (unsigned int v = 0; v < voice_count; v += 2)
+      {
+        synth_note_off(&reference, 45 + v);
+        synth_note_off(&synth, 45 + v);
+      }
+      released = true;
+    }
+    unsigned int n = sizes[b % (sizeof(sizes) / sizeof(sizes[0]))];
+    synth_render(&reference, expected, n);
+    worker_pool_render(pool, &synth, output, n);
+    for (unsigned int i = 0; i < n * channels; ++i)
+      if (fabs(output[i] - expected[i]) > max_error)
+        max_error = fabs(output[i] - expected[i]);
+    frames += n;
+  }
+  return max_error;
+}
+
+// Aliasing is measured on ALIAS_FRAMES frames holding exactly
+// [cycles] periods, with [cycles] prime: harmonics then fall exactly
+// on bins that are multiples of [cycles] and aliases never do.
+#define ALIAS_FRAMES 4096
+
+// Render ALIAS_FRAMES frames of [cycles] periods of [instrument].
+// Mode -1 is the naive per-sample oscillator, otherwise an
+// OscillatorMode.
+static void alias_render(int mode, Instrument instrument, float* output,
+                         unsigned int cycles)
+{
+  static Synth synth;
+  // Exact in fixed point, ALIAS_FRAMES is a power of two
+  Oscillator osc = { 0, cycles * (uint32_t)(0x100000000ull / ALIAS_FRAMES) };
+  if (mode < 0)
+  {
+    legacy_phase = 0.0f;
+    for (unsigned int i = 0; i < ALIAS_FRAMES; ++i)
+      legacy_oscillator(instrument, (float) cycles / ALIAS_FRAMES, &output[i]);
+    return;
+  }
+  synth_init(&synth, BENCH_SAMPLE_RATE);
+  synth.mode = mode;
+  synth_oscillator(&synth, instrument, output, ALIAS_FRAMES, &osc);
+}
+
+// Energy of the non-harmonic bins relative to the harmonic ones, in dB
+static double bench_alias(int mode, Instrument instrument, unsigned int cycles)
+{
+  static float signal[ALIAS_FRAMES];
+  static double cosine[ALIAS_FRAMES], sine[ALIAS_FRAMES];
+  for (unsigned int i = 0; i < ALIAS_FRAMES; ++i)
+  {
+    cosine[i] = cos(2 * SYNTH_PI * i / ALIAS_FRAMES);
+    sine[i] = sin(2 * SYNTH_PI * i / ALIAS_FRAMES);
+  }
+
+  alias_render(mode, instrument, signal, cycles);
+
+  double harmonic = 0.0, alias = 0.0;
+  for (unsigned int bin = 1; bin < ALIAS_FRAMES / 2; ++bin)
+  {
+    double re = 0.0, im = 0.0;
+    for (unsigned int i = 0; i < ALIAS_FRAMES; ++i)
+    {
+      unsigned int k = (bin * i) & (ALIAS_FRAMES - 1);
+      re += signal[i] * cosine[k];
+      im -= signal[i] * sine[k];
+    }
+    if (bin % cycles == 0) harmonic += re * re + im * im;
+    else alias += re * re + im * im;
+  }
+  return 10 * log10(alias / harmonic + 1e-30);
+}
+
+// Frames of the two windows bench_string() compares, and between them
+#define STRING_WINDOW 16384
+#define STRING_SPAN   (BENCH_SAMPLE_RATE / 2)
+
+typedef struct {
+  double pitch_cents;        // of the fundamental against the tuning
+  double t60;                // seconds to decay by 60 dB
+  unsigned int ring_bytes;   // of the ring of the string
+} BenchString;
+
+// Strike the string of MIDI [note] and demodulate its fundamental at
+// the frequency of the tuning over two windows STRING_SPAN frames
+// apart. The phase it drifts by between the windows is the error of
+// the pitch, the ratio of the magnitudes gives the decay.
+static BenchString bench_string(int note)
+{
+  static Synth synth;
+  static float output[STRING_WINDOW + STRING_SPAN];
+  synth_init(&synth, BENCH_SAMPLE_RATE);
+  synth_note_on(&synth, note, STRING, 1.0f, 0.0f);
+  for (unsigned int i = 0; i < STRING_WINDOW + STRING_SPAN; i += SYNTH_BLOCK_SIZE)
+    synth_render(&synth, output + i, SYNTH_BLOCK_SIZE);
+
+  const double frequency = synth.tuning.frequency[note];
+  double re[2] = {0}, im[2] = {0};
+  for (unsigned int w = 0; w < 2; ++w)
+  {
+    for (unsigned int i = 0; i < STRING_WINDOW; ++i)
+    {
+      unsigned int frame = w * STRING_SPAN + i;
+      double window = 0.5 - 0.5 * cos(2 * SYNTH_PI * i / STRING_WINDOW);
+      double angle = 2 * SYNTH_PI * frequency * frame / BENCH_SAMPLE_RATE;
+      re[w] += window * output[frame] * cos(angle);
+      im[w] -= window * output[frame] * sin(angle);
+    }
+  }
+  const double seconds = (double) STRING_SPAN / BENCH_SAMPLE_RATE;
+  double drift = atan2(im[1] * re[0] - re[1] * im[0], re[1] * re[0] + im[1] * im[0]);
+  double error = drift / (2 * SYNTH_PI * seconds);
+  double decay = 10 * log10((re[0] * re[0] + im[0] * im[0])
+                            / (re[1] * re[1] + im[1] * im[1]));
+  return (BenchString) {
+    .pitch_cents = 1200 * log2((frequency + error) / frequency),
+    .t60 = 60 * seconds / decay,
+    .ring_bytes = synth.string[0].delay * (unsigned int) sizeof(float),
+  };
+}
+
+//
+// Spectrum analysis
+//
+
+// Recursive FFT with stack arrays and a cexp() per butterfly, as
+// fft.c used to have before FFTPlan
+static void legacy_fft(const float* in_frames, float *out_frequencies,
+                       unsigned int window)
+{
+  if (window <= 1)
+    return;
+
+  float even[window / 2], odd[window / 2];
+  for (unsigned int i = 0; i < window / 2; i++)
+  {
+    even[i] = in_frames[i * 2];
+    odd[i] = in_frames[i * 2 + 1];
+  }
+  legacy_fft(even, out_frequencies, window / 2);
+  legacy_fft(odd, out_frequencies,  window / 2);
+
+  for (unsigned int i = 0; i < window / 2; ++i)
+  {
+    complex float twiddle = cexp(-2.0 * I * PI * (float)i / (float)window) * odd[i];
+    out_frequencies[i] = even[i] + twiddle;
+    out_frequencies[i + window / 2] = even[i] - twiddle;
+  }
+}
+
+#define FFT_SIZE_MAX (1<<16)
+// Largest sizes timed for the slow reference transforms
+#define FFT_LEGACY_SIZE_MAX (1<<14)
+#define DFT_SIZE_MAX        (1<<10)
+
+typedef enum {
+  FFT_KIND_DFT = 0,
+  FFT_KIND_RECURSIVE,
+  FFT_KIND_COMPLEX,        // fft() with the given radix-4 pass
+  FFT_KIND_REAL,           // fft_real()
+} FFTKind;
+
+// Time one transform of size [n] of [kind], per transform. Slow
+// kinds run fewer times.
+static BenchStats bench_fft(unsigned int n, FFTKind kind, FFTPass pass)
+{
+  static float input[FFT_SIZE_MAX], output[FFT_SIZE_MAX];
+  static double times[BENCH_RUNS];
+  for (unsigned int i = 0; i < n; ++i)
+    input[i] = sinf(i * 0.1f) + 0.5f * sinf(i * 0.37f);
+
+  FFTPlan* plan = fft_plan_create(n);
+  RealFFTPlan* real_plan = fft_real_plan_create(n);
+  if (!plan || !real_plan) exit(1);
+  if (pass) plan->radix4 = pass;
+
+  unsigned int runs = (kind == FFT_KIND_COMPLEX || kind == FFT_KIND_REAL)
+    ? BENCH_RUNS : BENCH_RUNS / 10;
+  unsigned int iterations = (n < BENCH_RUN_FRAMES) ? BENCH_RUN_FRAMES / n : 1;
+  for (int run = -1; run < (int) runs; ++run)
+  {
+    double start = bench_now();
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      switch(kind)
+      {
+      case FFT_KIND_DFT:       dft(input, output, n);        break;
+      case FFT_KIND_RECURSIVE: legacy_fft(input, output, n); break;
+      case FFT_KIND_COMPLEX:   fft(plan, input, output);     break;
+      case FFT_KIND_REAL:      fft_real(real_plan, input, output); break;
+      }
+    }
+    if (run >= 0) times[run] = bench_now() - start;
+  }
+  fft_plan_destroy(plan);
+  fft_real_plan_destroy(real_plan);
+
+  return bench_stats(times, runs, iterations);
+}
+
+// DFT of the [n] complex values [in_re], [in_im] in double precision,
+// the reference of the transforms. dft() itself accumulates in float
+// and is off by about 1e-4 of the peak at 1024 points.
+static void bench_reference_dft(const float* in_re, const float* in_im, unsigned int n,
+                                double* out_re, double* out_im)
+{
+  for (unsigned int k = 0; k < n; ++k)
+  {
+    double re = 0.0, im = 0.0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+      // Exact angle, k * i can be reduced modulo n first
+      double angle = -2 * SYNTH_PI * (double)((uint64_t) k * i % n) / n;
+      double x = in_re[i], y = in_im ? in_im[i] : 0.0;
+      re += x * cos(angle) - y * sin(angle);
+      im += x * sin(angle) + y * cos(angle);
+    }
+    out_re[k] = re;
+    out_im[k] = im;
+  }
+  return;
+}
+
+// Largest difference between the [n] magnitudes of [output] and those
+// of the reference [re], [im], relative to the largest one
+static double bench_magnitude_error(const float* output, const double* re,
+                                    const double* im, unsigned int n)
+{
+  double max_error = 0.0, max_value = 0.0;
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    double expected = sqrt(re[i] * re[i] + im[i] * im[i]);
+    if (fabs(output[i] - expected) > max_error) max_error = fabs(output[i] - expected);
+    if (expected > max_value) max_value = expected;
+  }
+  return max_error / max_value;
+}
+
+// Relative error of the magnitudes of size [n] of fft(), or of dft()
+// with [reference_dft]
+static double bench_fft_error(unsigned int n, bool reference_dft)
+{
+  static float input[FFT_SIZE_MAX], output[FFT_SIZE_MAX];
+  static double re[FFT_SIZE_MAX], im[FFT_SIZE_MAX];
+  for (unsigned int i = 0; i < n; ++i)
+    input[i] = sinf(i * 0.1f) + 0.5f * sinf(i * 0.37f);
+
+  if (reference_dft)
+  {
+    dft(input, output, n);
+  }
+  else
+  {
+    FFTPlan* plan = fft_plan_create(n);
+    if (!plan) exit(1);
+    fft(plan, input, output);
+    fft_plan_destroy(plan);
+  }
+  bench_reference_dft(input, NULL, n, re, im);
+  return bench_magnitude_error(output, re, im, n);
+}
+
+// Relative error of the magnitudes of fft_real() of size [n], of the
+// bins up to Nyquist
+static double bench_fft_real_error(unsigned int n)
+{
+  static float input[FFT_SIZE_MAX], output[FFT_SIZE_MAX];
+  static double re[FFT_SIZE_MAX], im[FFT_SIZE_MAX];
+  for (unsigned int i = 0; i < n; ++i)
+    input[i] = sinf(i * 0.1f) + 0.5f * sinf(i * 0.37f) + 0.25f;
+
+  RealFFTPlan* plan = fft_real_plan_create(n);
+  if (!plan) exit(1);
+  fft_real(plan, input, output);
+  fft_real_plan_destroy(plan);
+  bench_reference_dft(input, NULL, n, re, im);
+  return bench_magnitude_error(output, re, im, n / 2 + 1);
+}
+
+// Largest difference between fft_complex() of size [n] and the
+// reference, relative to the largest magnitude
+static double bench_fft_complex_error(unsigned int n)
+{
+  static complex float data[FFT_SIZE_MAX];
+  static float input_re[FFT_SIZE_MAX], input_im[FFT_SIZE_MAX];
+  static double re[FFT_SIZE_MAX], im[FFT_SIZE_MAX];
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    input_re[i] = sinf(i * 0.1f) + 0.5f * sinf(i * 0.37f);
+    input_im[i] = cosf(i * 0.23f) - 0.25f;
+    data[i] = input_re[i] + input_im[i] * I;
+  }
+
+  FFTPlan* plan = fft_plan_create(n);
+  if (!plan) exit(1);
+  fft_complex(plan, data);
+  fft_plan_destroy(plan);
+  bench_reference_dft(input_re, input_im, n, re, im);
+
+  double max_error = 0.0, max_value = 0.0;
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    double error = hypot(crealf(data[i]) - re[i], cimagf(data[i]) - im[i]);
+    if (error > max_error) max_error = error;
+    if (hypot(re[i], im[i]) > max_value) max_value = hypot(re[i], im[i]);
+  }
+  return max_error / max_value;
+}
+
+// Report a transform taking [stats] each, with GFLOPS counted as
+// 5 n log2(n) flops as usual for complex transforms
+static void bench_report_fft(BenchCase c, BenchStats stats)
+{
+  double flops = 5.0 * c.size * log2(c.size);
+  bench_report(c, 3, (BenchMetric[]) {
+      { "median_ns", stats.median },
+      { "p99_ns",    stats.p99 },
+      { "gflops",    flops / stats.median },
+    });
+  return;
+}
+
+//
+// Reverb
+//
+
+#define BENCH_REVERB_CHANNELS 2
+#define BENCH_REVERB_BLOCK    256
+#define BENCH_REVERB_RUNS     5
+
+typedef struct {
+  double cpu_percent;        // of one core, on average
+  BenchStats block;          // per frame, over every block
+} BenchReverb;
+
+typedef bool (*BenchReverbProcess)(void* reverb, float* output,
+                                   unsigned int frame_count, bool audible);
+
+// Run BENCH_REVERB_RUNS seconds of stereo noise through [process] of
+// [reverb], in blocks of BENCH_REVERB_BLOCK frames
+static BenchReverb bench_reverb(BenchReverbProcess process, void* reverb)
+{
+  enum { BLOCKS = BENCH_SAMPLE_RATE / BENCH_REVERB_BLOCK };
+  static float block[BENCH_REVERB_BLOCK * BENCH_REVERB_CHANNELS];
+  static double times[BENCH_REVERB_RUNS * BLOCKS];
+
+  double total = 0.0;
+  for (int run = -1; run < BENCH_REVERB_RUNS; ++run)
+  {
+    for (unsigned int b = 0; b < BLOCKS; ++b)
+    {
+      for (unsigned int i = 0; i < BENCH_REVERB_BLOCK * BENCH_REVERB_CHANNELS; ++i)
+        block[i] = (float) rand() / RAND_MAX - 0.5f;
+      double start = bench_now();
+      process(reverb, block, BENCH_REVERB_BLOCK, true);
+      double time = bench_now() - start;
+      if (run >= 0)
+      {
+        times[run * BLOCKS + b] = time;
+        total += time;
+      }
+    }
+  }
+
+  double audio = (double) BENCH_REVERB_RUNS * BLOCKS * BENCH_REVERB_BLOCK / BENCH_SAMPLE_RATE;
+  return (BenchReverb) {
+    .cpu_percent = 100.0 * total / audio,
+    .block = bench_stats(times, BENCH_REVERB_RUNS * BLOCKS, BENCH_REVERB_BLOCK),
+  };
+}
+
+static bool bench_convolver_process(void* reverb, float* output,
+                                    unsigned int frame_count, bool audible)
+{
+  return convolver_process(reverb, output, frame_count, audible);
+}
+
+static bool bench_fdn_process(void* reverb, float* output,
+                              unsigned int frame_count, bool audible)
+{
+  return fdn_process(reverb, output, frame_count, audible);
+}
+
+// Convolver with an impulse response of [seconds] of decaying noise
+static BenchReverb bench_convolver(double seconds, bool uniform)
+{
+  unsigned int length = (unsigned int)(seconds * BENCH_SAMPLE_RATE);
+  float* ir[BENCH_REVERB_CHANNELS];
+  for (unsigned int c = 0; c < BENCH_REVERB_CHANNELS; ++c)
+  {
+    ir[c] = malloc(length * sizeof(float));
+    if (!ir[c]) exit(1);
+    for (unsigned int i = 0; i < length; ++i)
+      ir[c][i] = ((float) rand() / RAND_MAX - 0.5f) * expf(-6.9f * i / length);
+  }
+  Convolver* convolver = convolver_create((const float* const*) ir,
+                                          BENCH_REVERB_CHANNELS, length,
+                                          BENCH_REVERB_CHANNELS, 1.0f, 0.3f, uniform);
+  if (!convolver) exit(1);
+
+  BenchReverb result = bench_reverb(bench_convolver_process, convolver);
+  convolver_destroy(convolver);
+  for (unsigned int c = 0; c < BENCH_REVERB_CHANNELS; ++c)
+    free(ir[c]);
+  return result;
+}
+
+// Frames of noise bench_convolver_error() feeds the convolver, the
+// rest is silence
+#define BENCH_CONVOLVER_INPUT 1024
+
+// Largest difference between a convolver with an impulse response of
+// [length] frames of decaying noise, fed in blocks of [block_size]
+// frames, and the convolution computed directly in double, relative
+// to the peak of the convolution. The input is a burst of noise
+// followed by enough silence for it to go through every tap.
+static double bench_convolver_error(unsigned int length, bool uniform,
+                                    unsigned int block_size)
+{
+  const unsigned int channels = BENCH_REVERB_CHANNELS;
+  const unsigned int frames = BENCH_CONVOLVER_INPUT + length;
+  float* input = malloc(frames * channels * sizeof(float));
+  float* output = malloc(frames * channels * sizeof(float));
+  if (!input || !output) exit(1);
+  float* ir[BENCH_REVERB_CHANNELS];
+  for (unsigned int c = 0; c < channels; ++c)
+  {
+    ir[c] = malloc(length * sizeof(float));
+    if (!ir[c]) exit(1);
+    for (unsigned int i = 0; i < length; ++i)
+      ir[c][i] = ((float) rand() / RAND_MAX - 0.5f) * expf(-6.9f * i / length);
+  }
+  for (unsigned int i = 0; i < frames * channels; ++i)
+  {
+    input[i] = (i < BENCH_CONVOLVER_INPUT * channels) ? (float) rand() / RAND_MAX - 0.5f : 0.0f;
+    output[i] = input[i];
+  }
+
+  Convolver* convolver = convolver_create((const float* const*) ir, channels, length,
+                                          channels, 0.0f, 1.0f, uniform);
+  if (!convolver) exit(1);
+  for (unsigned int done = 0; done < frames; done += block_size)
+  {
+    unsigned int n = (frames - done < block_size) ? frames - done : block_size;
+    convolver_process(convolver, output + done * channels, n,
+                      done < BENCH_CONVOLVER_INPUT);
+  }
+  convolver_destroy(convolver);
+
+  double max_error = 0.0, peak = 0.0;
+  for (unsigned int c = 0; c < channels; ++c)
+  {
+    for (unsigned int i = 0; i < frames; ++i)
+    {
+      // Input frame j meets tap i - j
+      unsigned int first = (i >= length) ? i - length + 1 : 0;
+      unsigned int last = (i < BENCH_CONVOLVER_INPUT) ? i : BENCH_CONVOLVER_INPUT - 1;
+      double expected = 0.0;
+      for (unsigned int j = first; j <= last; ++j)
+        expected += (double) ir[c][i - j] * input[j * channels + c];
+      if (fabs(output[i * channels + c] - expected) > max_error)
+        max_error = fabs(output[i * channels + c] - expected);
+      if (fabs(expected) > peak) peak = fabs(expected);
+    }
+    free(ir[c]);
+  }
+  free(input);
+  free(output);
+  return max_error / peak;
+}
+
+// Feedback delay network of [lines] lines with the default settings
+static BenchReverb bench_fdn(unsigned int lines)
+{
+  Fdn* fdn = fdn_create(lines, BENCH_REVERB_CHANNELS, BENCH_SAMPLE_RATE,
+                        FDN_TIME, FDN_DAMPING, 1.0f, FDN_WET);
+  if (!fdn) exit(1);
+  BenchReverb result = bench_reverb(bench_fdn_process, fdn);
+  fdn_destroy(fdn);
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--json") == 0)
+    {
+      bench_json = true;
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [--json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  static const char* names[INSTRUMENT_COUNT] = {
+    "sine", "square", "triangle", "saw", "string",
+  };
+  static const char* mode_names[OSCILLATOR_MODE_COUNT] = {
+    "analytic", "wavetable", "cubic",
+  };
+  static const unsigned int voice_counts[] = { 1, 8, 16, 32, 64 };
+  const unsigned int voice_counts_len = sizeof(voice_counts) / sizeof(voice_counts[0]);
+
+  static const unsigned int block_sizes[] = { 32, 64, 256, 1024, 4096 };
+  const unsigned int block_sizes_len = sizeof(block_sizes) / sizeof(block_sizes[0]);
+
+  simd_init();
+  bench_begin();
+
+  struct {
+    const char* name;
+    SineKernel kernel;
+  } sines[] = {
+    { "libm",   sine_block_libm },
+    { "scalar", sine_block_scalar },
+#ifdef SIMD_X86
+    { "sse2",   sine_block_sse2 },
+    { "avx2",   (sine_block == sine_block_avx2) ? sine_block_avx2 : NULL },
+#endif
+#ifdef SIMD_NEON
+    { "neon",   sine_block_neon },
+#endif
+  };
+  for (unsigned int i = 0; i < sizeof(sines) / sizeof(sines[0]); ++i)
+  {
+    if (!sines[i].kernel) continue;
+    BenchStats stats = bench_sine_kernel(sines[i].kernel);
+    BenchCase c = { "sine_kernel", sines[i].name, "sine", BENCH_BLOCK_SIZE, 1, 0 };
+    double error_db = bench_sine_error(sines[i].kernel);
+    bench_check(c, "error_db", error_db, BENCH_SINE_ERROR_DB);
+    bench_report(c, 4, (BenchMetric[]) {
+        { "error_db",  error_db },
+        { "median_ns", stats.median },
+        { "p99_ns",    stats.p99 },
+        { "realtime",  bench_realtime(stats.median) },
+      });
+  }
+
+  // One voice, per sample, against the per-sample switch it replaced
+  for (unsigned int instrument = 0; instrument < INSTRUMENT_COUNT; ++instrument)
+  {
+    if (!instrument_oscillator(instrument)) continue;
+    for (unsigned int i = 0; i < block_sizes_len; ++i)
+    {
+      for (int mode = -1; mode < OSCILLATOR_MODE_COUNT; ++mode)
+      {
+        BenchCase c = { "oscillator", names[instrument],
+                        (mode < 0) ? "per-sample" : mode_names[mode],
+                        block_sizes[i], 1, 0 };
+        bench_report_frames(c, bench_oscillator(instrument, block_sizes[i], mode));
+      }
+    }
+  }
+
+  static const unsigned int alias_cycles[] = { 97, 389 };
+  for (unsigned int c = 0; c < 2; ++c)
+  {
+    for (unsigned int instrument = 0; instrument < INSTRUMENT_COUNT; ++instrument)
+    {
+      if (!instrument_oscillator(instrument)) continue;
+      double naive_db = 0.0;
+      for (int mode = -1; mode < OSCILLATOR_MODE_COUNT; ++mode)
+      {
+        BenchCase bench_case = { "alias", names[instrument],
+                                 (mode < 0) ? "naive" : mode_names[mode],
+                                 0, 1, ALIAS_FRAMES };
+        double alias_db = bench_alias(mode, instrument, alias_cycles[c]);
+        if (mode < 0)
+          naive_db = alias_db;
+        else if (mode == OSCILLATOR_ANALYTIC && instrument != SINE)
+          bench_check(bench_case, "alias_db", alias_db, naive_db - BENCH_ALIAS_GAIN_DB);
+        bench_report(bench_case, 2, (BenchMetric[]) {
+            { "frequency_hz", (double) alias_cycles[c] * BENCH_SAMPLE_RATE / ALIAS_FRAMES },
+            { "alias_db",     alias_db },
+          });
+      }
+    }
+  }
+
+  BenchDrift drift = bench_drift();
+  BenchCase drift_case = { "drift", "sine", "analytic", BENCH_BLOCK_SIZE, 1, 0 };
+  bench_check(drift_case, "phase_error", fabs(drift.phase_error), 0);
+  bench_check(drift_case, "output_db", drift.output_db, BENCH_SINE_ERROR_DB);
+  bench_report(drift_case, 6,
+               (BenchMetric[]) {
+                 { "hours",             BENCH_DRIFT_HOURS },
+                 { "frames",            drift.frames },
+                 { "pitch_cents",       drift.pitch_cents },
+                 { "phase_error",       drift.phase_error },
+                 { "float_phase_error", drift.float_phase_error },
+                 { "output_db",         drift.output_db },
+               });
+
+  // The whole mix, per frame, with the cost of each voice and how
+  // many voices a core could sustain at that cost. Strings have no
+  // oscillator mode.
+  for (unsigned int instrument = 0; instrument < INSTRUMENT_COUNT; ++instrument)
+  {
+    bool oscillator = instrument_oscillator(instrument);
+    for (unsigned int mode = 0; mode < (oscillator ? OSCILLATOR_MODE_COUNT : 1); ++mode)
+    {
+      for (unsigned int i = 0; i < voice_counts_len; ++i)
+      {
+        unsigned int voices = voice_counts[i];
+        if (voices > VOICE_COUNT_MAX) break;
+        for (unsigned int j = 0; j < block_sizes_len; ++j)
+        {
+          if (block_sizes[j] > SYNTH_BLOCK_SIZE * 4) break;
+          BenchStats stats = bench_voices(mode, instrument, voices, block_sizes[j], 1, false,
+                                          NULL);
+          double realtime = bench_realtime(stats.median);
+          BenchCase c = { "mix", names[instrument],
+                          oscillator ? mode_names[mode] : "waveguide",
+                          block_sizes[j], voices, 0 };
+          bench_report(c, 5, (BenchMetric[]) {
+              { "median_ns",       stats.median },
+              { "p99_ns",          stats.p99 },
+              { "realtime",        realtime },
+              { "voice_ns",        stats.median / voices },
+              { "voices_per_core", realtime * voices },
+            });
+        }
+      }
+    }
+  }
+
+  // Tuning and decay of the strings, one A per octave
+  static const char* octave_names[] = { "A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7" };
+  for (unsigned int i = 0; i < sizeof(octave_names) / sizeof(octave_names[0]); ++i)
+  {
+    BenchString string = bench_string(21 + 12 * i);
+    BenchCase c = { "waveguide", "string", octave_names[i], 0, 1, 0 };
+    bench_report(c, 3, (BenchMetric[]) {
+        { "pitch_cents", string.pitch_cents },
+        { "t60_s",       string.t60 },
+        { "ring_bytes",  string.ring_bytes },
+      });
+  }
+
+  // Sine voices vectorized along time against one voice per lane,
+  // in the short blocks where time vectorization is weakest
+  static const char* layout_names[2] = { "time", "voices" };
+  for (unsigned int i = 0; i < voice_counts_len; ++i)
+  {
+    unsigned int voices = voice_counts[i];
+    if (voices > VOICE_COUNT_MAX) break;
+    for (unsigned int j = 0; j < 3; ++j)
+    {
+      for (unsigned int parallel = 0; parallel < 2; ++parallel)
+      {
+        BenchStats stats = bench_voices(OSCILLATOR_ANALYTIC, SINE, voices,
+                                        block_sizes[j], 1, parallel, NULL);
+        BenchCase c = { "voice_parallel", "sine", layout_names[parallel],
+                        block_sizes[j], voices, 0 };
+        bench_report(c, 4, (BenchMetric[]) {
+            { "median_ns", stats.median },
+            { "p99_ns",    stats.p99 },
+            { "realtime",  bench_realtime(stats.median) },
+            { "voice_ns",  stats.median / voices },
+          });
+      }
+    }
+  }
+
+  // The packs against one voice at a time, in four channels so that
+  // there are packs on every pair of buses
+  {
+    static const Instrument sine[] = { SINE };
+    BenchCase c = { "voice_parallel", "sine", "error", 0, VOICE_COUNT_MAX, 0 };
+    double error = bench_render_error(sine, 1, VOICE_COUNT_MAX, 4, true, NULL);
+    bench_check(c, "max_error", error, BENCH_RENDER_ERROR);
+    bench_report(c, 1, (BenchMetric[]) {{ "max_error", error }});
+  }
+
+  // 64 voices mixed into interleaved frames, against the mono mix
+  struct {
+    const char* name;
+    unsigned int channels;
+  } layouts[] = {
+    { "mono", 1 }, { "stereo", 2 }, { "8ch", 8 },
+  };
+  for (unsigned int i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i)
+  {
+    for (unsigned int j = 0; j < block_sizes_len; ++j)
+    {
+      if (block_sizes[j] > SYNTH_BLOCK_SIZE * 4) break;
+      BenchStats stats = bench_voices(OSCILLATOR_WAVETABLE, SINE, VOICE_COUNT_MAX,
+                                      block_sizes[j], layouts[i].channels, false,
+                                      NULL);
+      BenchCase c = { "channels", "sine", layouts[i].name,
+                      block_sizes[j], VOICE_COUNT_MAX, 0 };
+      bench_report(c, 4, (BenchMetric[]) {
+          { "median_ns", stats.median },
+          { "p99_ns",    stats.p99 },
+          { "realtime",  bench_realtime(stats.median) },
+          { "sample_ns", stats.median / layouts[i].channels },
+        });
+    }
+  }
+
+  // The same mix of all the instruments with 1 and 3 workers against
+  // the audio thread alone. With fewer cores than threads the workers
+  // come late and their chunks are taken back.
+  static const char* thread_names[] = { "1", "2", "4", "8", "16" };
+  for (unsigned int i = 1; i < 3; ++i)
+  {
+    static const Instrument mixed[] = { SINE, SQUARE, TRIANGLE, SAW, STRING };
+    unsigned int threads = 1u << i;
+    WorkerPool* pool = worker_pool_create(threads - 1);
+    if (!pool) break;
+    BenchCase c = { "workers", "mixed", thread_names[i], 0, VOICE_COUNT_MAX, 0 };
+    double error = bench_render_error(mixed, sizeof(mixed) / sizeof(mixed[0]),
+                                      VOICE_COUNT_MAX, 2, false, pool);
+    worker_pool_destroy(pool);
+    bench_check(c, "max_error", error, BENCH_RENDER_ERROR);
+    bench_report(c, 1, (BenchMetric[]) {{ "max_error", error }});
+  }
+
+  // 64 saw voices shared by the audio thread and 0 to 15 workers.
+  // With more threads than cores the workers come late and the audio
+  // thread has to render their chunks too.
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (unsigned int j = 1; j < 3; ++j)
+  {
+    double single = 0.0;
+    for (unsigned int i = 0; i < sizeof(thread_names) / sizeof(thread_names[0]); ++i)
+    {
+      unsigned int threads = 1u << i;
+      WorkerPool* pool = worker_pool_create(threads - 1);
+      if (threads > 1 && !pool) break;
+      BenchStats stats = bench_voices(OSCILLATOR_ANALYTIC, SAW, VOICE_COUNT_MAX,
+                                      block_sizes[j], 1, false, pool);
+      worker_pool_destroy(pool);
+      if (threads == 1) single = stats.median;
+      BenchCase c = { "workers", "saw", thread_names[i],
+                      block_sizes[j], VOICE_COUNT_MAX, 0 };
+      bench_report(c, 5, (BenchMetric[]) {
+          { "median_ns", stats.median },
+          { "p99_ns",    stats.p99 },
+          { "realtime",  bench_realtime(stats.median) },
+          { "speedup",   single / stats.median },
+          { "cores",     (double) cores },
+        });
+    }
+  }
+
+  struct {
+    const char* name;
+    FFTPass pass;
+  } passes[] = {
+    { "scalar", fft_radix4_scalar },
+#ifdef SIMD_X86
+    { "sse2",   fft_radix4_sse2 },
+    { "avx2",   (simd_level == SIMD_AVX2) ? fft_radix4_avx2 : NULL },
+#endif
+  };
+  for (unsigned int n = 128; n <= FFT_SIZE_MAX; n *= 2)
+  {
+    if (n <= DFT_SIZE_MAX)
+      bench_report_fft((BenchCase) { "fft", "dft", "complex", 0, 0, n },
+                       bench_fft(n, FFT_KIND_DFT, NULL));
+    if (n <= FFT_LEGACY_SIZE_MAX)
+      bench_report_fft((BenchCase) { "fft", "recursive", "complex", 0, 0, n },
+                       bench_fft(n, FFT_KIND_RECURSIVE, NULL));
+    for (unsigned int i = 0; i < sizeof(passes) / sizeof(passes[0]); ++i)
+    {
+      if (!passes[i].pass) continue;
+      bench_report_fft((BenchCase) { "fft", passes[i].name, "complex", 0, 0, n },
+                       bench_fft(n, FFT_KIND_COMPLEX, passes[i].pass));
+    }
+    bench_report_fft((BenchCase) { "fft", "planned", "real", 0, 0, n },
+                     bench_fft(n, FFT_KIND_REAL, NULL));
+  }
+  for (unsigned int n = 128; n <= 1024; n *= 2)
+  {
+    struct {
+      const char* name;
+      const char* variant;
+      double error;
+      double limit;
+    } errors[] = {
+      { "fft", "magnitude", bench_fft_error(n, false),  BENCH_FFT_ERROR },
+      { "fft", "complex",   bench_fft_complex_error(n), BENCH_FFT_ERROR },
+      { "fft", "real",      bench_fft_real_error(n),    BENCH_FFT_ERROR },
+      { "dft", "magnitude", bench_fft_error(n, true),   BENCH_DFT_ERROR },
+    };
+    for (unsigned int i = 0; i < sizeof(errors) / sizeof(errors[0]); ++i)
+    {
+      BenchCase c = { "fft_error", errors[i].name, errors[i].variant, 0, 0, n };
+      bench_check(c, "relative_error", errors[i].error, errors[i].limit);
+      bench_report(c, 1, (BenchMetric[]) {{ "relative_error", errors[i].error }});
+    }
+  }
+
+  // Stereo convolution reverb with non-uniform and uniform
+  // partitions. The p99 of the blocks shows how well the work of the
+  // large partitions is spread out.
+  static const double ir_seconds[] = { 0.5, 1.0, 2.0, 5.0 };
+  static const char* partition_names[2] = { "nonuniform", "uniform" };
+  for (unsigned int i = 0; i < sizeof(ir_seconds) / sizeof(ir_seconds[0]); ++i)
+  {
+    for (unsigned int uniform = 0; uniform < 2; ++uniform)
+    {
+      BenchReverb reverb = bench_convolver(ir_seconds[i], uniform);
+      BenchCase c = { "convolver", partition_names[uniform], "stereo",
+                      BENCH_REVERB_BLOCK, 0,
+                      (unsigned int)(ir_seconds[i] * BENCH_SAMPLE_RATE) };
+      bench_report(c, 4, (BenchMetric[]) {
+          { "ir_seconds",  ir_seconds[i] },
+          { "cpu_percent", reverb.cpu_percent },
+          { "median_ns",   reverb.block.median },
+          { "p99_ns",      reverb.block.p99 },
+        });
+    }
+  }
+
+  // The partitioned convolution against the direct one, with impulse
+  // responses around the ends of the head and of the small partitions
+  // and blocks that are not multiples of CONVOLVER_BLOCK
+  static const unsigned int ir_lengths[] = {
+    1, CONVOLVER_BLOCK - 1, CONVOLVER_BLOCK, CONVOLVER_BLOCK + 1, 1000,
+    2 * CONVOLVER_LARGE - 1, 2 * CONVOLVER_LARGE, 2 * CONVOLVER_LARGE + 1, 20000,
+  };
+  static const unsigned int convolver_blocks[] = { 1, 100, CONVOLVER_BLOCK, 1000 };
+  for (unsigned int i = 0; i < sizeof(ir_lengths) / sizeof(ir_lengths[0]); ++i)
+  {
+    for (unsigned int uniform = 0; uniform < 2; ++uniform)
+    {
+      double error = 0.0;
+      for (unsigned int j = 0; j < sizeof(convolver_blocks) / sizeof(convolver_blocks[0]); ++j)
+        error = fmax(error, bench_convolver_error(ir_lengths[i], uniform, convolver_blocks[j]));
+      BenchCase c = { "convolver_error", partition_names[uniform], "stereo", 0, 0,
+                      ir_lengths[i] };
+      bench_check(c, "relative_error", error, BENCH_REVERB_ERROR);
+      bench_report(c, 1, (BenchMetric[]) {{ "relative_error", error }});
+    }
+  }
+
+  // The feedback delay network, the cheap alternative
+  static const char* line_names[2] = { "8", "16" };
+  for (unsigned int i = 0; i < 2; ++i)
+  {
+    BenchReverb reverb = bench_fdn(8 << i);
+    BenchCase c = { "fdn", line_names[i], "stereo", BENCH_REVERB_BLOCK, 0, 0 };
+    bench_report(c, 3, (BenchMetric[]) {
+        { "cpu_percent", reverb.cpu_percent },
+        { "median_ns",   reverb.block.median },
+        { "p99_ns",      reverb.block.p99 },
+      });
+  }
+
+  bench_end();
+  if (bench_failures)
+  {
+    fprintf(stderr, "%u checks failed\n", bench_failures);
+    return 1;
+  }
+  return 0;
+}
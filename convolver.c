@@ -0,0 +1,526 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// convolver.c
+// ===========
+//
+// Partitioned convolution reverb in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// The output of the synth is convolved with a recorded impulse
+// response, one per channel, with no latency and a bounded amount of
+// work per block:
+//
+//  - the first CONVOLVER_BLOCK taps are applied directly in time, so
+//    a sound is heard in the very frame it is played;
+//  - the taps up to 2 * CONVOLVER_LARGE are applied by uniformly
+//    partitioned overlap-save convolution with partitions of
+//    CONVOLVER_BLOCK frames: every CONVOLVER_BLOCK frames the last two
+//    blocks of input are transformed with a real FFT, the spectra of
+//    the last blocks are multiplied by those of the partitions of the
+//    impulse response and summed, and the inverse FFT gives the next
+//    CONVOLVER_BLOCK frames of output;
+//  - the rest of the impulse response is done the same way with
+//    partitions of CONVOLVER_LARGE frames, which take a sixteenth of
+//    the work per frame. Since these taps start two large partitions
+//    late, the output of a large block is only needed one large block
+//    after its input is complete, so its products are spread over the
+//    small blocks in between instead of all landing in one callback.
+//
+// A convolver can also be made with small partitions only, which is
+// what the benchmarks compare against.
+//
+// Frames are processed in place on the interleaved output of the
+// synth, with any number of frames per call. When the synth stays
+// silent for longer than the impulse response nothing is done at all.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Taps applied in time, and partition of the first stage
+#define CONVOLVER_BLOCK  128
+// Partition of the second stage, a multiple of CONVOLVER_BLOCK
+#define CONVOLVER_LARGE  2048
+#define CONVOLVER_STAGES 2
+// Level of the reverb added to the dry sound by default
+#define CONVOLVER_WET    0.3f
+
+// Adds the complex products of [x] and [h] to [acc], [bins] values of
+// split real and imaginary parts
+typedef void (*ConvolverMac)(float* restrict acc_re, float* restrict acc_im,
+                             const float* restrict x_re, const float* restrict x_im,
+                             const float* restrict h_re, const float* restrict h_im,
+                             unsigned int bins);
+
+// Adds to [output] frame i the sum over k < [taps] of
+// [head][k] * [input][i - k], for [frame_count] frames
+typedef void (*ConvolverHead)(float* restrict output, const float* restrict input,
+                              const float* restrict head, unsigned int taps,
+                              unsigned int frame_count);
+
+// One uniformly partitioned overlap-save convolution over the taps
+// from [offset] on, which is [delay] partitions
+typedef struct {
+  unsigned int size;           // frames per partition, FFT of twice as many
+  unsigned int partitions;
+  unsigned int delay;          // 1: played right after the input block,
+                               // 2: one block later, computed in slices
+  unsigned int slices;         // CONVOLVER_BLOCK blocks per partition
+  unsigned int phase;          // blocks since the last partition boundary
+  unsigned int newest;         // slot of the newest input spectrum
+  RealFFTPlan* plan;
+  float* spectrum_re;          // [channels][partitions][size + 1] impulse response
+  float* spectrum_im;
+  float* input_re;             // [channels][partitions][size + 1] last inputs
+  float* input_im;
+  float* sum_re;               // [channels][size + 1] products being summed
+  float* sum_im;
+  float* window;               // [channels][2 size] last two input blocks
+  float* output;               // [channels][2 size] playing, then being computed
+  float* scratch;              // [2 size]
+} ConvolverStage;
+
+typedef struct {
+  unsigned int channels;
+  unsigned int length;         // frames of the impulse response
+  float dry;
+  float wet;
+  ConvolverMac  mac;
+  ConvolverHead head_kernel;
+  float head[SYNTH_CHANNELS_MAX][CONVOLVER_BLOCK];
+  float input[SYNTH_CHANNELS_MAX][2 * CONVOLVER_BLOCK]; // last and current block
+  float wet_block[CONVOLVER_BLOCK];
+  unsigned int position;       // frames into the current block
+  uint64_t ringing;            // frames until the last sound has died out
+  unsigned int stage_count;
+  ConvolverStage stage[CONVOLVER_STAGES];
+} Convolver;
+
+void convolver_mac(float* restrict acc_re, float* restrict acc_im,
+                   const float* restrict x_re, const float* restrict x_im,
+                   const float* restrict h_re, const float* restrict h_im,
+                   unsigned int bins)
+{
+  for (unsigned int k = 0; k < bins; ++k)
+  {
+    acc_re[k] += x_re[k] * h_re[k] - x_im[k] * h_im[k];
+    acc_im[k] += x_re[k] * h_im[k] + x_im[k] * h_re[k];
+  }
+  return;
+}
+
+void convolver_head(float* restrict output, const float* restrict input,
+                    const float* restrict head, unsigned int taps,
+                    unsigned int frame_count)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    float sum = 0.0f;
+    for (unsigned int k = 0; k < taps; ++k)
+      sum += head[k] * input[(int) i - (int) k];
+    output[i] += sum;
+  }
+  return;
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2,fma")))
+void convolver_mac_avx2(float* restrict acc_re, float* restrict acc_im,
+                        const float* restrict x_re, const float* restrict x_im,
+                        const float* restrict h_re, const float* restrict h_im,
+                        unsigned int bins)
+{
+  unsigned int k = 0;
+  for (; k + 8 <= bins; k += 8)
+  {
+    __m256 xr = _mm256_loadu_ps(x_re + k), xi = _mm256_loadu_ps(x_im + k);
+    __m256 hr = _mm256_loadu_ps(h_re + k), hi = _mm256_loadu_ps(h_im + k);
+    __m256 re = _mm256_fmadd_ps(xr, hr, _mm256_loadu_ps(acc_re + k));
+    __m256 im = _mm256_fmadd_ps(xr, hi, _mm256_loadu_ps(acc_im + k));
+    _mm256_storeu_ps(acc_re + k, _mm256_fnmadd_ps(xi, hi, re));
+    _mm256_storeu_ps(acc_im + k, _mm256_fmadd_ps(xi, hr, im));
+  }
+  convolver_mac(acc_re + k, acc_im + k, x_re + k, x_im + k, h_re + k, h_im + k,
+                bins - k);
+  return;
+}
+
+// Eight frames at a time, each in its own lane
+__attribute__((target("avx2,fma")))
+void convolver_head_avx2(float* restrict output, const float* restrict input,
+                         const float* restrict head, unsigned int taps,
+                         unsigned int frame_count)
+{
+  unsigned int i = 0;
+  for (; i + 8 <= frame_count; i += 8)
+  {
+    __m256 sum = _mm256_setzero_ps();
+    for (unsigned int k = 0; k < taps; ++k)
+      sum = _mm256_fmadd_ps(_mm256_set1_ps(head[k]),
+                            _mm256_loadu_ps(input + (int) i - (int) k), sum);
+    _mm256_storeu_ps(output + i, _mm256_add_ps(_mm256_loadu_ps(output + i), sum));
+  }
+  convolver_head(output + i, input + i, head, taps, frame_count - i);
+  return;
+}
+
+#endif // SIMD_X86
+
+static void convolver_stage_free(ConvolverStage* stage)
+{
+  fft_real_plan_destroy(stage->plan);
+  free(stage->spectrum_re);
+  memset(stage, 0, sizeof(*stage));
+  return;
+}
+
+void convolver_destroy(Convolver* convolver)
+{
+  if (!convolver) return;
+  for (unsigned int s = 0; s < convolver->stage_count; ++s)
+    convolver_stage_free(&convolver->stage[s]);
+  free(convolver);
+  return;
+}
+
+// Set up [stage] for the taps of [ir] from [offset] to before [end]
+// in partitions of [size] frames
+static bool convolver_stage_init(ConvolverStage* stage, const float* const* ir,
+                                 unsigned int ir_channels, unsigned int channels,
+                                 unsigned int offset, unsigned int end,
+                                 unsigned int size)
+{
+  const unsigned int bins = size + 1;
+  stage->size = size;
+  stage->partitions = (end - offset + size - 1) / size;
+  stage->delay = offset / size;
+  stage->slices = size / CONVOLVER_BLOCK;
+  stage->plan = fft_real_plan_create(2 * size);
+
+  // Everything in one allocation, freed with the first array
+  const size_t spectra = (size_t) channels * stage->partitions * bins;
+  const size_t floats = 4 * spectra + 2 * channels * bins
+                        + 4 * channels * size + 2 * size;
+  float* memory = calloc(floats, sizeof(float));
+  if (!stage->plan || !memory)
+  {
+    fft_real_plan_destroy(stage->plan);
+    free(memory);
+    memset(stage, 0, sizeof(*stage));
+    return false;
+  }
+  stage->spectrum_re = memory;           memory += spectra;
+  stage->spectrum_im = memory;           memory += spectra;
+  stage->input_re    = memory;           memory += spectra;
+  stage->input_im    = memory;           memory += spectra;
+  stage->sum_re      = memory;           memory += channels * bins;
+  stage->sum_im      = memory;           memory += channels * bins;
+  stage->window      = memory;           memory += 2 * channels * size;
+  stage->output      = memory;           memory += 2 * channels * size;
+  stage->scratch     = memory;
+
+  // Spectra of the partitions, zero padded to the size of the FFT.
+  // Channels beyond those of the impulse response reuse its channels.
+  for (unsigned int c = 0; c < channels; ++c)
+  {
+    const float* taps = ir[c % ir_channels];
+    for (unsigned int p = 0; p < stage->partitions; ++p)
+    {
+      unsigned int first = offset + p * size;
+      unsigned int count = (end - first < size) ? end - first : size;
+      memset(stage->scratch, 0, 2 * size * sizeof(float));
+      memcpy(stage->scratch, taps + first, count * sizeof(float));
+      size_t slot = ((size_t) c * stage->partitions + p) * bins;
+      fft_real_spectrum(stage->plan, stage->scratch,
+                        stage->spectrum_re + slot, stage->spectrum_im + slot);
+    }
+  }
+  return true;
+}
+
+// Create a convolver for [channels] interleaved channels with the
+// impulse responses [ir] of [length] frames, one per channel up to
+// [ir_channels], the others reusing them. With [uniform] every tap
+// after the first block goes through partitions of CONVOLVER_BLOCK
+// frames. The output is [dry] times the input plus [wet] times the
+// convolution. Returns NULL on failure.
+Convolver* convolver_create(const float* const* ir, unsigned int ir_channels,
+                            unsigned int length, unsigned int channels,
+                            float dry, float wet, bool uniform)
+{
+  if (ir_channels == 0 || length == 0 || channels == 0
+      || channels > SYNTH_CHANNELS_MAX)
+    return NULL;
+
+  Convolver* convolver = calloc(1, sizeof(Convolver));
+  if (!convolver)
+    return NULL;
+  convolver->channels = channels;
+  convolver->length = length;
+  convolver->dry = dry;
+  convolver->wet = wet;
+  simd_init();
+  convolver->mac = convolver_mac;
+  convolver->head_kernel = convolver_head;
+#ifdef SIMD_X86
+  if (simd_level == SIMD_AVX2)
+  {
+    convolver->mac = convolver_mac_avx2;
+    convolver->head_kernel = convolver_head_avx2;
+  }
+#endif
+
+  unsigned int head = (length < CONVOLVER_BLOCK) ? length : CONVOLVER_BLOCK;
+  for (unsigned int c = 0; c < channels; ++c)
+    for (unsigned int k = 0; k < head; ++k)
+      convolver->head[c][k] = ir[c % ir_channels][k];
+
+  unsigned int small_end = (uniform || length < 2 * CONVOLVER_LARGE)
+    ? length : 2 * CONVOLVER_LARGE;
+  bool ok = true;
+  if (small_end > CONVOLVER_BLOCK)
+    ok = convolver_stage_init(&convolver->stage[convolver->stage_count++], ir,
+                              ir_channels, channels, CONVOLVER_BLOCK, small_end,
+                              CONVOLVER_BLOCK);
+  if (ok && length > small_end)
+    ok = convolver_stage_init(&convolver->stage[convolver->stage_count++], ir,
+                              ir_channels, channels, small_end, length,
+                              CONVOLVER_LARGE);
+  if (!ok)
+  {
+    convolver_destroy(convolver);
+    return NULL;
+  }
+  return convolver;
+}
+
+// Forget all past input, as if [convolver] was just created
+void convolver_reset(Convolver* convolver)
+{
+  const unsigned int channels = convolver->channels;
+  memset(convolver->input, 0, sizeof(convolver->input));
+  for (unsigned int s = 0; s < convolver->stage_count; ++s)
+  {
+    // Everything after the spectra of the impulse response
+    ConvolverStage* stage = &convolver->stage[s];
+    size_t spectra = (size_t) channels * stage->partitions * (stage->size + 1);
+    memset(stage->input_re, 0,
+           (2 * spectra + 2 * channels * (stage->size + 1) + 4 * channels * stage->size)
+           * sizeof(float));
+  }
+  convolver->ringing = 0;
+  return;
+}
+
+// Called every CONVOLVER_BLOCK frames, once input[c] holds a whole
+// new block
+static void convolver_stage_step(Convolver* convolver, ConvolverStage* stage)
+{
+  const unsigned int channels = convolver->channels;
+  const unsigned int size = stage->size, bins = size + 1;
+  const unsigned int partitions = stage->partitions;
+
+  for (unsigned int c = 0; c < channels; ++c)
+    memcpy(stage->window + (2 * c + 1) * size + stage->phase * CONVOLVER_BLOCK,
+           convolver->input[c] + CONVOLVER_BLOCK, CONVOLVER_BLOCK * sizeof(float));
+
+  if (++stage->phase == stage->slices)
+  {
+    // A whole partition of input: its spectrum replaces the oldest one
+    stage->phase = 0;
+    stage->newest = (stage->newest + 1) % partitions;
+    for (unsigned int c = 0; c < channels; ++c)
+    {
+      float* window = stage->window + 2 * c * size;
+      size_t slot = ((size_t) c * partitions + stage->newest) * bins;
+      fft_real_spectrum(stage->plan, window,
+                        stage->input_re + slot, stage->input_im + slot);
+      memcpy(window, window + size, size * sizeof(float));
+      memset(stage->sum_re + c * bins, 0, bins * sizeof(float));
+      memset(stage->sum_im + c * bins, 0, bins * sizeof(float));
+
+      // Play what was computed during the last partition
+      if (stage->delay == 2)
+        memcpy(stage->output + 2 * c * size, stage->output + (2 * c + 1) * size,
+               size * sizeof(float));
+    }
+  }
+
+  // One slice of the products, the last slice finishes the output
+  const unsigned int per_slice = (partitions + stage->slices - 1) / stage->slices;
+  const unsigned int first = stage->phase * per_slice;
+  const unsigned int last = (first + per_slice < partitions) ? first + per_slice : partitions;
+  for (unsigned int c = 0; c < channels; ++c)
+  {
+    float* sum_re = stage->sum_re + c * bins;
+    float* sum_im = stage->sum_im + c * bins;
+    for (unsigned int p = first; p < last; ++p)
+    {
+      unsigned int input = (stage->newest + partitions - p) % partitions;
+      size_t x = ((size_t) c * partitions + input) * bins;
+      size_t h = ((size_t) c * partitions + p) * bins;
+      convolver->mac(sum_re, sum_im, stage->input_re + x, stage->input_im + x,
+                     stage->spectrum_re + h, stage->spectrum_im + h, bins);
+    }
+    if (stage->phase == stage->slices - 1)
+    {
+      // The second half of the inverse is the part free of wrap around
+      fft_real_inverse(stage->plan, sum_re, sum_im, stage->scratch);
+      float* output = stage->output + (2 * c + stage->delay - 1) * size;
+      memcpy(output, stage->scratch + size, size * sizeof(float));
+    }
+  }
+  return;
+}
+
+// Convolve [frame_count] interleaved frames of [output] in place.
+// [audible] is false if the frames are all silent. Returns false if
+// they still are.
+bool convolver_process(Convolver* convolver, float* output,
+                       unsigned int frame_count, bool audible)
+{
+  const unsigned int channels = convolver->channels;
+  if (audible)
+  {
+    // Until the sound has left the windows, the spectra and the
+    // outputs of every stage, with room for the rounding to partitions
+    convolver->ringing = convolver->length + 4 * CONVOLVER_LARGE;
+  }
+  else
+  {
+    if (convolver->ringing == 0)
+      return false;
+    convolver->ringing -= (frame_count < convolver->ringing)
+      ? frame_count : convolver->ringing;
+  }
+
+  for (unsigned int done = 0; done < frame_count; )
+  {
+    unsigned int position = convolver->position;
+    unsigned int n = frame_count - done;
+    if (n > CONVOLVER_BLOCK - position) n = CONVOLVER_BLOCK - position;
+
+    float* frames = output + done * channels;
+    for (unsigned int c = 0; c < channels; ++c)
+    {
+      float* input = convolver->input[c] + CONVOLVER_BLOCK + position;
+      for (unsigned int i = 0; i < n; ++i)
+        input[i] = frames[i * channels + c];
+
+      float* wet = convolver->wet_block;
+      memset(wet, 0, n * sizeof(float));
+      for (unsigned int s = 0; s < convolver->stage_count; ++s)
+      {
+        const ConvolverStage* stage = &convolver->stage[s];
+        const float* tail = stage->output + 2 * c * stage->size
+          + stage->phase * CONVOLVER_BLOCK + position;
+        for (unsigned int i = 0; i < n; ++i)
+          wet[i] += tail[i];
+      }
+      unsigned int taps = (convolver->length < CONVOLVER_BLOCK)
+        ? convolver->length : CONVOLVER_BLOCK;
+      convolver->head_kernel(wet, input, convolver->head[c], taps, n);
+
+      for (unsigned int i = 0; i < n; ++i)
+        frames[i * channels + c] = convolver->dry * input[i] + convolver->wet * wet[i];
+    }
+
+    convolver->position += n;
+    done += n;
+    if (convolver->position == CONVOLVER_BLOCK)
+    {
+      for (unsigned int s = 0; s < convolver->stage_count; ++s)
+        convolver_stage_step(convolver, &convolver->stage[s]);
+      for (unsigned int c = 0; c < channels; ++c)
+        memcpy(convolver->input[c], convolver->input[c] + CONVOLVER_BLOCK,
+               CONVOLVER_BLOCK * sizeof(float));
+      convolver->position = 0;
+    }
+  }
+  return true;
+}
+
+#ifdef miniaudio_h
+
+// Load the impulse response at [path], any format miniaudio decodes,
+// resampled to [sample_rate], and create a convolver for [channels]
+// channels with it, see convolver_create(). The response is scaled
+// to unit energy on its loudest channel, so [wet] does not depend on
+// the recording. Prints the error to stderr and returns NULL on
+// failure.
+Convolver* convolver_load(const char* path, unsigned int sample_rate,
+                          unsigned int channels, float dry, float wet)
+{
+  ma_decoder_config config = ma_decoder_config_init(ma_format_f32, 0, sample_rate);
+  ma_decoder decoder;
+  if (ma_decoder_init_file(path, &config, &decoder) != MA_SUCCESS)
+  {
+    fprintf(stderr, "Error opening impulse response %s\n", path);
+    return NULL;
+  }
+  unsigned int ir_channels = decoder.outputChannels;
+  if (ir_channels > SYNTH_CHANNELS_MAX) ir_channels = SYNTH_CHANNELS_MAX;
+
+  // The length is not known in advance for every format
+  float* frames = NULL;
+  ma_uint64 length = 0, capacity = 0, read = 0;
+  do
+  {
+    if (length == capacity)
+    {
+      capacity = capacity ? capacity * 2 : sample_rate;
+      float* grown = realloc(frames, capacity * decoder.outputChannels * sizeof(float));
+      if (!grown)
+        break;
+      frames = grown;
+    }
+    read = 0;
+    ma_decoder_read_pcm_frames(&decoder, frames + length * decoder.outputChannels,
+                               capacity - length, &read);
+    length += read;
+  } while (read > 0);
+
+  float* planar = (frames && length > 0 && length <= UINT32_MAX)
+    ? malloc(length * ir_channels * sizeof(float)) : NULL;
+  Convolver* convolver = NULL;
+  if (planar)
+  {
+    const float* ir[SYNTH_CHANNELS_MAX];
+    double loudest = 0.0;
+    for (unsigned int c = 0; c < ir_channels; ++c)
+    {
+      double energy = 0.0;
+      for (ma_uint64 i = 0; i < length; ++i)
+      {
+        float value = frames[i * decoder.outputChannels + c];
+        planar[c * length + i] = value;
+        energy += (double) value * value;
+      }
+      if (energy > loudest) loudest = energy;
+      ir[c] = planar + c * length;
+    }
+    float scale = (loudest > 0.0) ? (float)(1.0 / sqrt(loudest)) : 0.0f;
+    for (ma_uint64 i = 0; i < length * ir_channels; ++i)
+      planar[i] *= scale;
+    convolver = convolver_create(ir, ir_channels, (unsigned int) length, channels,
+                                 dry, wet, false);
+  }
+  if (!convolver)
+    fprintf(stderr, "Error loading impulse response %s\n", path);
+
+  free(planar);
+  free(frames);
+  ma_decoder_uninit(&decoder);
+  return convolver;
+}
+
+#endif // miniaudio_h
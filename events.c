@@ -0,0 +1,159 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// events.c
+// ========
+//
+// Wait-free single-producer/single-consumer event queue in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// The UI thread is the only producer and the audio callback is the
+// only consumer, so the queue needs no locks: each side owns one
+// index and publishes it with a release store. Events are stamped
+// with the monotonic clock when pushed and the callback applies them
+// at the matching frame of the next block, which delays every event
+// by one block but keeps the spacing between events sample-accurate.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Must be a power of two
+#define EVENT_QUEUE_SIZE (1<<8)
+
+// Keeps the producer and consumer indices on different cache lines
+#define CACHE_LINE_SIZE 64
+
+typedef enum {
+  EVENT_NOTE_ON = 0,
+  EVENT_NOTE_OFF,
+  EVENT_MASTER,      // set the master volume to [amplitude]
+  EVENT_MODE,        // set the oscillator mode to [note]
+  EVENT_TUNING,      // play TUNING_ROOT at [frequency] Hz
+} EventType;
+
+typedef struct {
+  EventType  type;
+  int        note;
+  Instrument instrument;
+  float      frequency;
+  float      amplitude;
+  float      pan;        // of a note on, -1 to 1
+  uint64_t   time;       // CLOCK_MONOTONIC nanoseconds
+} Event;
+
+typedef struct {
+  uint32_t head;                              // written by the producer
+  unsigned char pad0[CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint32_t tail;                              // written by the consumer
+  unsigned char pad1[CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint64_t block_time;                        // owned by the consumer
+  Event events[EVENT_QUEUE_SIZE];
+} EventQueue;
+
+uint64_t event_time_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+void event_queue_init(EventQueue* queue)
+{
+  queue->head = 0;
+  queue->tail = 0;
+  queue->block_time = 0;
+  return;
+}
+
+// Producer side. Returns false if the queue is full, in which case
+// the event is dropped.
+bool event_queue_push(EventQueue* queue, const Event* event)
+{
+  uint32_t head = queue->head;
+  uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  if (head - tail == EVENT_QUEUE_SIZE)
+    return false;
+
+  queue->events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Consumer side. Returns false if the queue is empty.
+bool event_queue_pop(EventQueue* queue, Event* event)
+{
+  uint32_t tail = queue->tail;
+  uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return false;
+
+  *event = queue->events[tail & (EVENT_QUEUE_SIZE - 1)];
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void synth_apply_event(Synth* synth, const Event* event)
+{
+  switch(event->type)
+  {
+  case EVENT_NOTE_ON:
+    synth_note_on(synth, event->note, event->instrument, event->amplitude,
+                  event->pan);
+    break;
+  case EVENT_NOTE_OFF:
+    synth_note_off(synth, event->note);
+    break;
+  case EVENT_MASTER:
+    synth->master = event->amplitude;
+    break;
+  case EVENT_MODE:
+    synth->mode = (OscillatorMode) event->note;
+    break;
+  case EVENT_TUNING:
+    synth_tune(synth, event->frequency);
+    break;
+  }
+  return;
+}
+
+// Render [frame_count] interleaved frames starting at [block_time],
+// applying every pending event of [queue] at its own frame offset. An event pushed
+// during the previous block lands at the same distance from the
+// start of this block. The voices are shared with the workers of
+// [pool], or rendered on this thread alone if [pool] is NULL.
+// Returns false if the whole block is silent.
+bool synth_render_events(Synth* synth, WorkerPool* pool, EventQueue* queue,
+                         float* output, unsigned int frame_count,
+                         uint64_t block_time)
+{
+  double frames_per_ns = synth->sample_rate / 1e9;
+  unsigned int position = 0;
+  bool audible = false;
+  Event event;
+  while (event_queue_pop(queue, &event))
+  {
+    unsigned int offset = 0;
+    if (event.time > queue->block_time)
+    {
+      double frames = (event.time - queue->block_time) * frames_per_ns;
+      offset = (frames < frame_count) ? (unsigned int) frames : frame_count;
+    }
+    if (offset > position)
+    {
+      audible |= worker_pool_render(pool, synth, output + position * synth->channels,
+                                    offset - position);
+      position = offset;
+    }
+    synth_apply_event(synth, &event);
+  }
+  audible |= worker_pool_render(pool, synth, output + position * synth->channels,
+                                frame_count - position);
+
+  queue->block_time = block_time;
+  return audible;
+}
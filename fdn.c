@@ -0,0 +1,317 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// fdn.c
+// =====
+//
+// Feedback delay network reverb in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// A much cheaper reverb than convolution, with no recorded room: 8 or
+// 16 delay lines of prime lengths between 21 and 63 ms feed each
+// other through a Hadamard matrix, which is orthogonal, so the sound
+// keeps circulating and gets denser without growing. Each pass
+// through a line loses the gain that makes it decay by 60 dB in the
+// reverb time, and a little more in the highs through a two tap
+// filter.
+//
+// Every line is a ring buffer of a power of two frames, indexed with
+// a mask. Since all lines are longer than FDN_BLOCK frames, a block
+// of that many frames can be read from every line before any of it
+// is written back, so the network runs a block at a time: the matrix
+// is applied to rows of frames, and its butterflies are plain SIMD
+// adds and subtracts of the rows, a vector of frames at a time.
+//
+// Channel c takes the lines c, c + channels, ... as input and output,
+// with alternating signs.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FDN_LINES_MAX 16
+// Frames per step, shorter than the shortest line
+#define FDN_BLOCK     64
+// Defaults
+#define FDN_TIME      2.0f   // seconds to decay by 60 dB
+#define FDN_DAMPING   0.3f   // 0 to 0.5, how much faster the highs decay
+#define FDN_WET       0.3f
+
+// Applies the unnormalized Hadamard matrix of size [lines] to the
+// [lines] rows, to each of the first [frame_count] frames
+typedef void (*FdnMatrix)(float (*rows)[FDN_BLOCK], unsigned int lines,
+                          unsigned int frame_count);
+
+typedef struct {
+  unsigned int lines;
+  unsigned int channels;
+  float dry;
+  float wet;
+  float damping;
+  float input_gain;
+  float output_gain;
+  unsigned int delay[FDN_LINES_MAX];
+  float gain[FDN_LINES_MAX];         // per pass, with the normalization of the matrix
+  float last[FDN_LINES_MAX];         // last frame read from each line
+  unsigned int mask;                 // frames of each line - 1
+  unsigned int write;                // position of the next frame written
+  float* buffer;                     // [lines][mask + 1]
+  uint64_t ringing;                  // frames until the lines are cleared
+  uint64_t ring_frames;              // after the last sound
+  FdnMatrix matrix;
+  float rows[FDN_LINES_MAX][FDN_BLOCK];
+  float input[SYNTH_CHANNELS_MAX][FDN_BLOCK];
+} Fdn;
+
+// Lengths at 48 kHz, prime and roughly evenly spaced in logarithm.
+// 8 line networks take every other one.
+static const unsigned int fdn_delays[FDN_LINES_MAX] = {
+  1009, 1087, 1163, 1249, 1361, 1447, 1553, 1693,
+  1801, 1933, 2081, 2239, 2411, 2591, 2789, 3001,
+};
+
+void fdn_matrix_scalar(float (*rows)[FDN_BLOCK], unsigned int lines,
+                       unsigned int frame_count)
+{
+  for (unsigned int h = 1; h < lines; h *= 2)
+  {
+    for (unsigned int i = 0; i < lines; i += 2 * h)
+    {
+      for (unsigned int j = i; j < i + h; ++j)
+      {
+        float* a = rows[j];
+        float* b = rows[j + h];
+        for (unsigned int k = 0; k < frame_count; ++k)
+        {
+          float x = a[k], y = b[k];
+          a[k] = x + y;
+          b[k] = x - y;
+        }
+      }
+    }
+  }
+  return;
+}
+
+#ifdef SIMD_X86
+
+// Rounds [frame_count] up to whole vectors, the rows are FDN_BLOCK
+// frames long and what is past the end is never read
+void fdn_matrix_sse2(float (*rows)[FDN_BLOCK], unsigned int lines,
+                     unsigned int frame_count)
+{
+  for (unsigned int h = 1; h < lines; h *= 2)
+  {
+    for (unsigned int i = 0; i < lines; i += 2 * h)
+    {
+      for (unsigned int j = i; j < i + h; ++j)
+      {
+        float* a = rows[j];
+        float* b = rows[j + h];
+        for (unsigned int k = 0; k < frame_count; k += 4)
+        {
+          __m128 x = _mm_loadu_ps(a + k), y = _mm_loadu_ps(b + k);
+          _mm_storeu_ps(a + k, _mm_add_ps(x, y));
+          _mm_storeu_ps(b + k, _mm_sub_ps(x, y));
+        }
+      }
+    }
+  }
+  return;
+}
+
+__attribute__((target("avx2,fma")))
+void fdn_matrix_avx2(float (*rows)[FDN_BLOCK], unsigned int lines,
+                     unsigned int frame_count)
+{
+  for (unsigned int h = 1; h < lines; h *= 2)
+  {
+    for (unsigned int i = 0; i < lines; i += 2 * h)
+    {
+      for (unsigned int j = i; j < i + h; ++j)
+      {
+        float* a = rows[j];
+        float* b = rows[j + h];
+        for (unsigned int k = 0; k < frame_count; k += 8)
+        {
+          __m256 x = _mm256_loadu_ps(a + k), y = _mm256_loadu_ps(b + k);
+          _mm256_storeu_ps(a + k, _mm256_add_ps(x, y));
+          _mm256_storeu_ps(b + k, _mm256_sub_ps(x, y));
+        }
+      }
+    }
+  }
+  return;
+}
+
+#endif // SIMD_X86
+
+void fdn_destroy(Fdn* fdn)
+{
+  if (!fdn) return;
+  free(fdn->buffer);
+  free(fdn);
+  return;
+}
+
+// Create a network of 8 or 16 [lines] for [channels] interleaved
+// channels at [sample_rate], decaying by 60 dB in [time] seconds.
+// The output is [dry] times the input plus [wet] times the reverb.
+// Returns NULL on failure.
+Fdn* fdn_create(unsigned int lines, unsigned int channels, double sample_rate,
+                float time, float damping, float dry, float wet)
+{
+  if ((lines != 8 && lines != 16) || channels == 0
+      || channels > SYNTH_CHANNELS_MAX || time <= 0.0f)
+    return NULL;
+
+  Fdn* fdn = calloc(1, sizeof(Fdn));
+  if (!fdn)
+    return NULL;
+  fdn->lines = lines;
+  fdn->channels = channels;
+  fdn->dry = dry;
+  fdn->wet = wet;
+  fdn->damping = damping;
+  fdn->input_gain = 1.0f / sqrtf((float) lines / channels);
+  fdn->output_gain = 1.0f / sqrtf((float) lines / channels);
+
+  unsigned int longest = 0;
+  for (unsigned int i = 0; i < lines; ++i)
+  {
+    unsigned int delay = (unsigned int) lround(fdn_delays[i * 16 / lines]
+                                               * sample_rate / 48000.0);
+    if (delay < FDN_BLOCK) delay = FDN_BLOCK;
+    fdn->delay[i] = delay;
+    fdn->gain[i] = powf(10.0f, -3.0f * delay / (time * (float) sample_rate))
+                   / sqrtf((float) lines);
+    if (delay > longest) longest = delay;
+  }
+  unsigned int size = 1;
+  while (size < longest + FDN_BLOCK) size *= 2;
+  fdn->mask = size - 1;
+  fdn->buffer = calloc((size_t) lines * size, sizeof(float));
+  if (!fdn->buffer)
+  {
+    free(fdn);
+    return NULL;
+  }
+  // Down by 120 dB by then
+  fdn->ring_frames = (uint64_t)(2.0 * time * sample_rate) + size;
+
+  simd_init();
+  fdn->matrix = fdn_matrix_scalar;
+#ifdef SIMD_X86
+  fdn->matrix = (simd_level == SIMD_AVX2) ? fdn_matrix_avx2 : fdn_matrix_sse2;
+#endif
+  return fdn;
+}
+
+// Silence the lines
+void fdn_reset(Fdn* fdn)
+{
+  memset(fdn->buffer, 0, (size_t) fdn->lines * (fdn->mask + 1) * sizeof(float));
+  memset(fdn->last, 0, sizeof(fdn->last));
+  fdn->ringing = 0;
+  return;
+}
+
+// Run [frame_count] frames of the network, n <= FDN_BLOCK
+static void fdn_step(Fdn* fdn, float* output, unsigned int n)
+{
+  const unsigned int lines = fdn->lines, channels = fdn->channels;
+  const unsigned int size = fdn->mask + 1;
+
+  for (unsigned int c = 0; c < channels; ++c)
+    for (unsigned int k = 0; k < n; ++k)
+      fdn->input[c][k] = output[k * channels + c];
+
+  // Read the lines through the loss filter
+  const float d = fdn->damping;
+  for (unsigned int i = 0; i < lines; ++i)
+  {
+    const float* line = fdn->buffer + (size_t) i * size;
+    unsigned int start = (fdn->write - fdn->delay[i]) & fdn->mask;
+    unsigned int first = (n < size - start) ? n : size - start;
+    float* row = fdn->rows[i];
+    memcpy(row, line + start, first * sizeof(float));
+    memcpy(row + first, line, (n - first) * sizeof(float));
+
+    const float g = fdn->gain[i];
+    float previous = fdn->last[i];
+    fdn->last[i] = row[n - 1];
+    for (unsigned int k = 0; k < n; ++k)
+    {
+      float current = row[k];
+      row[k] = g * ((1.0f - d) * current + d * previous);
+      previous = current;
+    }
+  }
+
+  for (unsigned int c = 0; c < channels; ++c)
+  {
+    float wet[FDN_BLOCK] = {0};
+    float sign = fdn->output_gain;
+    for (unsigned int i = c; i < lines; i += channels, sign = -sign)
+      for (unsigned int k = 0; k < n; ++k)
+        wet[k] += sign * fdn->rows[i][k];
+    for (unsigned int k = 0; k < n; ++k)
+      output[k * channels + c] = fdn->dry * fdn->input[c][k] + fdn->wet * wet[k];
+  }
+
+  fdn->matrix(fdn->rows, lines, n);
+
+  for (unsigned int i = 0; i < lines; ++i)
+  {
+    float* row = fdn->rows[i];
+    const float* input = fdn->input[i % channels];
+    const float gain = (i / channels % 2) ? -fdn->input_gain : fdn->input_gain;
+    for (unsigned int k = 0; k < n; ++k)
+      row[k] += gain * input[k];
+
+    float* line = fdn->buffer + (size_t) i * size;
+    unsigned int start = fdn->write & fdn->mask;
+    unsigned int first = (n < size - start) ? n : size - start;
+    memcpy(line + start, row, first * sizeof(float));
+    memcpy(line, row + first, (n - first) * sizeof(float));
+  }
+  fdn->write = (fdn->write + n) & fdn->mask;
+  return;
+}
+
+// Add the reverb to [frame_count] interleaved frames of [output], in
+// place. [audible] is false if the frames are all silent. Returns
+// false if they still are.
+bool fdn_process(Fdn* fdn, float* output, unsigned int frame_count, bool audible)
+{
+  if (audible)
+  {
+    fdn->ringing = fdn->ring_frames;
+  }
+  else
+  {
+    if (fdn->ringing == 0)
+      return false;
+    if (fdn->ringing <= frame_count)
+    {
+      // Inaudible by now, start from silence next time
+      fdn_reset(fdn);
+      return false;
+    }
+    fdn->ringing -= frame_count;
+  }
+
+  for (unsigned int done = 0; done < frame_count; done += FDN_BLOCK)
+  {
+    unsigned int n = frame_count - done;
+    if (n > FDN_BLOCK) n = FDN_BLOCK;
+    fdn_step(fdn, output + done * fdn->channels, n);
+  }
+  return true;
+}
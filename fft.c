@@ -12,29 +12,16 @@
 //
 
 #include <complex.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
 
 #ifndef PI
 #define PI      3.14159265358979323846264f
 #endif
 
-// Must be a power of two for FFT
-#define FRAME_COUNT_MAX (1<<7)
-#define FREQUENCY_SCALING 0.52
-float frames[FRAME_COUNT_MAX] = {0};       // audio samples
-float frequencies[FRAME_COUNT_MAX] = {0};  // filled by FFT
-
-// Just copy [in_frames] to [out_frequencies], used for visualizations
-// or debugging
-void frames_as_frequencies(const float* in_frames, float *out_frequencies,
-         unsigned int n_frames)
-{
-  for (unsigned int i = 0; i < n_frames; ++i)
-    out_frequencies[i] = in_frames[i];
-  return;
-}
-
-// Calculates the Discrete Furier Transform of [in_frames], saved in
-// [out_frequencies]
+// Calculates the Discrete Furier Transform of [in_frames], saving
+// the magnitude of each frequency in [out_frequencies]
 void dft(const float* in_frames, float *out_frequencies,
          unsigned int n_frames)
 {
@@ -52,7 +39,7 @@ void dft(const float* in_frames, float *out_frequencies,
     // never picked up (for example, if the input is a sine, and our
     // selected frequency is a cosine, the sum of their prducts will
     // always be zero and we don't get much information).
-    out_frequencies[freq] = 0;
+    complex float sum = 0;
     for (unsigned int frame = 0; frame < n_frames; ++frame)
     {
       float t = (float) frame / n_frames;
@@ -60,36 +47,494 @@ void dft(const float* in_frames, float *out_frequencies,
       //     e^{ix} = cos(x) + i * sin(x)
       // Using imaginary number is just a shortcut to encode information
       // for both sine and cosine.
-      out_frequencies[freq] += in_frames[frame] * cexpf(-2 * I * PI * freq * t);
+      sum += in_frames[frame] * cexpf(-2 * I * PI * freq * t);
     }
+    out_frequencies[freq] = cabsf(sum);
   }
   return;
 }
 
-// The Fast Furier Transform of [in_frames], saved in [out_frequencies]
-void fft(const float* in_frames, float *out_frequencies,
-         unsigned int window)
+// Complex product written out by hand: the * operator goes through
+// __mulsc3() to handle infinities, which is several times slower
+static inline complex float complex_mul(complex float a, complex float b)
+{
+  float ar = crealf(a), ai = cimagf(a);
+  float br = crealf(b), bi = cimagf(b);
+  return (ar * br - ai * bi) + (ar * bi + ai * br) * I;
+}
+
+// The FFT works on split real and imaginary arrays and combines the
+// radix-2 stages two at a time into radix-4 passes: a pass with
+// quarter size [h] takes the 4 points k, k + h, k + 2h and k + 3h of
+// every group of 4h, multiplies the last three by w^2k, w^k and w^3k
+// (w = e^{-2 pi i / 4h}) and adds them up. That is 3 complex products
+// per 4 points instead of 4 for two radix-2 stages, and the loop over
+// k reads every array contiguously, so it maps directly to SIMD
+// lanes. The twiddles of a pass are stored as 6 arrays of h floats:
+// real and imaginary parts of w^k, w^2k and w^3k.
+typedef void (*FFTPass)(float* restrict re, float* restrict im,
+                        unsigned int n, unsigned int h,
+                        const float* restrict twiddles);
+
+// Radix-4 butterfly of the points [k] of the group at [re], [im]
+static inline void fft_radix4_butterfly(float* restrict re, float* restrict im,
+                                        unsigned int h, unsigned int k,
+                                        const float* restrict twiddles)
+{
+  const float* w1r = twiddles;
+  const float* w1i = twiddles + h;
+  const float* w2r = twiddles + 2 * h;
+  const float* w2i = twiddles + 3 * h;
+  const float* w3r = twiddles + 4 * h;
+  const float* w3i = twiddles + 5 * h;
+
+  float ar = re[k],         ai = im[k];
+  float br = re[k + h],     bi = im[k + h];
+  float cr = re[k + 2 * h], ci = im[k + 2 * h];
+  float dr = re[k + 3 * h], di = im[k + 3 * h];
+
+  // b by w^2k, c by w^k, d by w^3k
+  float tbr = br * w2r[k] - bi * w2i[k], tbi = br * w2i[k] + bi * w2r[k];
+  float tcr = cr * w1r[k] - ci * w1i[k], tci = cr * w1i[k] + ci * w1r[k];
+  float tdr = dr * w3r[k] - di * w3i[k], tdi = dr * w3i[k] + di * w3r[k];
+
+  float sr = ar + tbr, si = ai + tbi;    // a + b
+  float mr = ar - tbr, mi = ai - tbi;    // a - b
+  float pr = tcr + tdr, pi = tci + tdi;  // c + d
+  float qr = tcr - tdr, qi = tci - tdi;  // c - d
+
+  re[k]         = sr + pr; im[k]         = si + pi;
+  re[k + h]     = mr + qi; im[k + h]     = mi - qr;  // a - b - i(c - d)
+  re[k + 2 * h] = sr - pr; im[k + 2 * h] = si - pi;
+  re[k + 3 * h] = mr - qi; im[k + 3 * h] = mi + qr;  // a - b + i(c - d)
+  return;
+}
+
+void fft_radix4_scalar(float* restrict re, float* restrict im,
+                       unsigned int n, unsigned int h,
+                       const float* restrict twiddles)
 {
-  // Base case
-  if (window <= 1)
+  for (unsigned int start = 0; start < n; start += 4 * h)
+    for (unsigned int k = 0; k < h; ++k)
+      fft_radix4_butterfly(re + start, im + start, h, k, twiddles);
+  return;
+}
+
+#ifdef SIMD_X86
+
+void fft_radix4_sse2(float* restrict re, float* restrict im,
+                     unsigned int n, unsigned int h,
+                     const float* restrict twiddles)
+{
+  if (h < 4)
+  {
+    fft_radix4_scalar(re, im, n, h, twiddles);
     return;
+  }
+
+  for (unsigned int start = 0; start < n; start += 4 * h)
+  {
+    float* r = re + start;
+    float* i = im + start;
+    for (unsigned int k = 0; k < h; k += 4)
+    {
+      __m128 w1r = _mm_loadu_ps(twiddles + k),         w1i = _mm_loadu_ps(twiddles + h + k);
+      __m128 w2r = _mm_loadu_ps(twiddles + 2 * h + k), w2i = _mm_loadu_ps(twiddles + 3 * h + k);
+      __m128 w3r = _mm_loadu_ps(twiddles + 4 * h + k), w3i = _mm_loadu_ps(twiddles + 5 * h + k);
+
+      __m128 ar = _mm_loadu_ps(r + k),         ai = _mm_loadu_ps(i + k);
+      __m128 br = _mm_loadu_ps(r + k + h),     bi = _mm_loadu_ps(i + k + h);
+      __m128 cr = _mm_loadu_ps(r + k + 2 * h), ci = _mm_loadu_ps(i + k + 2 * h);
+      __m128 dr = _mm_loadu_ps(r + k + 3 * h), di = _mm_loadu_ps(i + k + 3 * h);
+
+      __m128 tbr = _mm_sub_ps(_mm_mul_ps(br, w2r), _mm_mul_ps(bi, w2i));
+      __m128 tbi = _mm_add_ps(_mm_mul_ps(br, w2i), _mm_mul_ps(bi, w2r));
+      __m128 tcr = _mm_sub_ps(_mm_mul_ps(cr, w1r), _mm_mul_ps(ci, w1i));
+      __m128 tci = _mm_add_ps(_mm_mul_ps(cr, w1i), _mm_mul_ps(ci, w1r));
+      __m128 tdr = _mm_sub_ps(_mm_mul_ps(dr, w3r), _mm_mul_ps(di, w3i));
+      __m128 tdi = _mm_add_ps(_mm_mul_ps(dr, w3i), _mm_mul_ps(di, w3r));
+
+      __m128 sr = _mm_add_ps(ar, tbr), si = _mm_add_ps(ai, tbi);
+      __m128 mr = _mm_sub_ps(ar, tbr), mi = _mm_sub_ps(ai, tbi);
+      __m128 pr = _mm_add_ps(tcr, tdr), pi = _mm_add_ps(tci, tdi);
+      __m128 qr = _mm_sub_ps(tcr, tdr), qi = _mm_sub_ps(tci, tdi);
+
+      _mm_storeu_ps(r + k,         _mm_add_ps(sr, pr));
+      _mm_storeu_ps(i + k,         _mm_add_ps(si, pi));
+      _mm_storeu_ps(r + k + h,     _mm_add_ps(mr, qi));
+      _mm_storeu_ps(i + k + h,     _mm_sub_ps(mi, qr));
+      _mm_storeu_ps(r + k + 2 * h, _mm_sub_ps(sr, pr));
+      _mm_storeu_ps(i + k + 2 * h, _mm_sub_ps(si, pi));
+      _mm_storeu_ps(r + k + 3 * h, _mm_sub_ps(mr, qi));
+      _mm_storeu_ps(i + k + 3 * h, _mm_add_ps(mi, qr));
+    }
+  }
+  return;
+}
+
+__attribute__((target("avx2,fma")))
+void fft_radix4_avx2(float* restrict re, float* restrict im,
+                     unsigned int n, unsigned int h,
+                     const float* restrict twiddles)
+{
+  if (h < 8)
+  {
+    fft_radix4_sse2(re, im, n, h, twiddles);
+    return;
+  }
+
+  for (unsigned int start = 0; start < n; start += 4 * h)
+  {
+    float* r = re + start;
+    float* i = im + start;
+    for (unsigned int k = 0; k < h; k += 8)
+    {
+      __m256 w1r = _mm256_loadu_ps(twiddles + k),         w1i = _mm256_loadu_ps(twiddles + h + k);
+      __m256 w2r = _mm256_loadu_ps(twiddles + 2 * h + k), w2i = _mm256_loadu_ps(twiddles + 3 * h + k);
+      __m256 w3r = _mm256_loadu_ps(twiddles + 4 * h + k), w3i = _mm256_loadu_ps(twiddles + 5 * h + k);
+
+      __m256 ar = _mm256_loadu_ps(r + k),         ai = _mm256_loadu_ps(i + k);
+      __m256 br = _mm256_loadu_ps(r + k + h),     bi = _mm256_loadu_ps(i + k + h);
+      __m256 cr = _mm256_loadu_ps(r + k + 2 * h), ci = _mm256_loadu_ps(i + k + 2 * h);
+      __m256 dr = _mm256_loadu_ps(r + k + 3 * h), di = _mm256_loadu_ps(i + k + 3 * h);
+
+      __m256 tbr = _mm256_fmsub_ps(br, w2r, _mm256_mul_ps(bi, w2i));
+      __m256 tbi = _mm256_fmadd_ps(br, w2i, _mm256_mul_ps(bi, w2r));
+      __m256 tcr = _mm256_fmsub_ps(cr, w1r, _mm256_mul_ps(ci, w1i));
+      __m256 tci = _mm256_fmadd_ps(cr, w1i, _mm256_mul_ps(ci, w1r));
+      __m256 tdr = _mm256_fmsub_ps(dr, w3r, _mm256_mul_ps(di, w3i));
+      __m256 tdi = _mm256_fmadd_ps(dr, w3i, _mm256_mul_ps(di, w3r));
+
+      __m256 sr = _mm256_add_ps(ar, tbr), si = _mm256_add_ps(ai, tbi);
+      __m256 mr = _mm256_sub_ps(ar, tbr), mi = _mm256_sub_ps(ai, tbi);
+      __m256 pr = _mm256_add_ps(tcr, tdr), pi = _mm256_add_ps(tci, tdi);
+      __m256 qr = _mm256_sub_ps(tcr, tdr), qi = _mm256_sub_ps(tci, tdi);
+
+      _mm256_storeu_ps(r + k,         _mm256_add_ps(sr, pr));
+      _mm256_storeu_ps(i + k,         _mm256_add_ps(si, pi));
+      _mm256_storeu_ps(r + k + h,     _mm256_add_ps(mr, qi));
+      _mm256_storeu_ps(i + k + h,     _mm256_sub_ps(mi, qr));
+      _mm256_storeu_ps(r + k + 2 * h, _mm256_sub_ps(sr, pr));
+      _mm256_storeu_ps(i + k + 2 * h, _mm256_sub_ps(si, pi));
+      _mm256_storeu_ps(r + k + 3 * h, _mm256_sub_ps(mr, qi));
+      _mm256_storeu_ps(i + k + 3 * h, _mm256_add_ps(mi, qr));
+    }
+  }
+  return;
+}
+
+#endif // SIMD_X86
+
+// Everything the FFT of a given size needs that does not depend on
+// the input, computed once by fft_plan_create()
+typedef struct {
+  unsigned int n;                // must be a power of two
+  bool odd_stages;               // log2(n) is odd, one radix-2 stage first
+  unsigned int* bit_reverse;     // [n] input index of each output
+  float* twiddles;               // 6h floats for every radix-4 pass
+  float* re;                     // [n] scratch, real parts
+  float* im;                     // [n] scratch, imaginary parts
+  FFTPass radix4;                // fastest radix-4 pass for this CPU
+} FFTPlan;
+
+// Returns NULL if [n] is not a power of two or memory is exhausted
+FFTPlan* fft_plan_create(unsigned int n)
+{
+  if (n == 0 || (n & (n - 1)) != 0)
+    return NULL;
+
+  FFTPlan* plan = malloc(sizeof(FFTPlan));
+  if (!plan) return NULL;
+  plan->n = n;
+  plan->bit_reverse = malloc(n * sizeof(unsigned int));
+  plan->twiddles = malloc(2 * n * sizeof(float));
+  plan->re = malloc(n * sizeof(float));
+  plan->im = malloc(n * sizeof(float));
+  if (!plan->bit_reverse || !plan->twiddles || !plan->re || !plan->im)
+  {
+    free(plan->bit_reverse);
+    free(plan->twiddles);
+    free(plan->re);
+    free(plan->im);
+    free(plan);
+    return NULL;
+  }
+
+  unsigned int bits = 0;
+  while ((1u << bits) < n) ++bits;
+  plan->odd_stages = bits % 2;
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    unsigned int reversed = 0;
+    for (unsigned int b = 0; b < bits; ++b)
+      if (i & (1u << b)) reversed |= 1u << (bits - 1 - b);
+    plan->bit_reverse[i] = reversed;
+  }
+
+  // Computed in double, the error of cexpf() would pile up over the
+  // log2(n) stages
+  float* twiddles = plan->twiddles;
+  for (unsigned int h = plan->odd_stages ? 2 : 1; 4 * h <= n; h *= 4)
+  {
+    for (unsigned int m = 1; m <= 3; ++m)
+    {
+      for (unsigned int k = 0; k < h; ++k)
+      {
+        double angle = -2.0 * 3.14159265358979323846264 * m * k / (4.0 * h);
+        twiddles[(2 * m - 2) * h + k] = cos(angle);
+        twiddles[(2 * m - 1) * h + k] = sin(angle);
+      }
+    }
+    twiddles += 6 * h;
+  }
+
+  simd_init();
+  plan->radix4 = fft_radix4_scalar;
+#ifdef SIMD_X86
+  plan->radix4 = (simd_level == SIMD_AVX2) ? fft_radix4_avx2 : fft_radix4_sse2;
+#endif
+  return plan;
+}
+
+void fft_plan_destroy(FFTPlan* plan)
+{
+  if (!plan) return;
+  free(plan->bit_reverse);
+  free(plan->twiddles);
+  free(plan->re);
+  free(plan->im);
+  free(plan);
+  return;
+}
+
+// All stages of the decimation in time FFT over [re] and [im], which
+// must already be in bit-reversed order
+static void fft_passes(const FFTPlan* plan, float* re, float* im)
+{
+  const unsigned int n = plan->n;
+  unsigned int h = 1;
+  if (plan->odd_stages)
+  {
+    // The first stage has a twiddle of 1 everywhere
+    for (unsigned int k = 0; k < n; k += 2)
+    {
+      float ar = re[k], ai = im[k];
+      re[k] = ar + re[k + 1];
+      im[k] = ai + im[k + 1];
+      re[k + 1] = ar - re[k + 1];
+      im[k + 1] = ai - im[k + 1];
+    }
+    h = 2;
+  }
+
+  const float* twiddles = plan->twiddles;
+  for (; 4 * h <= n; h *= 4)
+  {
+    plan->radix4(re, im, n, h, twiddles);
+    twiddles += 6 * h;
+  }
+  return;
+}
+
+// In place complex FFT of the [plan->n] values of [data]
+void fft_complex(FFTPlan* plan, complex float* data)
+{
+  for (unsigned int i = 0; i < plan->n; ++i)
+  {
+    complex float value = data[plan->bit_reverse[i]];
+    plan->re[i] = crealf(value);
+    plan->im[i] = cimagf(value);
+  }
+  fft_passes(plan, plan->re, plan->im);
+  for (unsigned int i = 0; i < plan->n; ++i)
+    data[i] = plan->re[i] + plan->im[i] * I;
+  return;
+}
+
+// The Fast Furier Transform of the [plan->n] samples of [in_frames],
+// saving the magnitude of each frequency in [out_frequencies]. Uses
+// the scratch buffers of [plan], so a plan can not be shared between
+// threads.
+void fft(FFTPlan* plan, const float* in_frames, float *out_frequencies)
+{
+  for (unsigned int i = 0; i < plan->n; ++i)
+  {
+    plan->re[i] = in_frames[plan->bit_reverse[i]];
+    plan->im[i] = 0.0f;
+  }
+  fft_passes(plan, plan->re, plan->im);
+
+  // sqrtf() instead of cabsf(), which goes through the much slower
+  // overflow-safe hypotf()
+  for (unsigned int i = 0; i < plan->n; ++i)
+    out_frequencies[i] = sqrtf(plan->re[i] * plan->re[i] + plan->im[i] * plan->im[i]);
+  return;
+}
+
+// Plan for the FFT of [n] real samples. The samples are packed in
+// pairs as n/2 complex values, transformed with a complex plan of
+// half the size and then separated back into the spectrum of the even
+// and odd samples, which halves both work and memory.
+typedef struct {
+  unsigned int n;                // must be a power of two, at least 2
+  FFTPlan* half;                 // complex plan of size n/2
+  float* twiddles_re;            // [n/2] real part of e^{-2 pi i k / n}
+  float* twiddles_im;            // [n/2] imaginary part
+} RealFFTPlan;
+
+// Returns NULL if [n] is not a power of two >= 2 or memory is exhausted
+RealFFTPlan* fft_real_plan_create(unsigned int n)
+{
+  if (n < 2 || (n & (n - 1)) != 0)
+    return NULL;
+
+  RealFFTPlan* plan = malloc(sizeof(RealFFTPlan));
+  if (!plan) return NULL;
+  plan->n = n;
+  plan->half = fft_plan_create(n / 2);
+  plan->twiddles_re = malloc((n / 2) * sizeof(float));
+  plan->twiddles_im = malloc((n / 2) * sizeof(float));
+  if (!plan->half || !plan->twiddles_re || !plan->twiddles_im)
+  {
+    fft_plan_destroy(plan->half);
+    free(plan->twiddles_re);
+    free(plan->twiddles_im);
+    free(plan);
+    return NULL;
+  }
+
+  for (unsigned int k = 0; k < n / 2; ++k)
+  {
+    plan->twiddles_re[k] = cos(-2.0 * 3.14159265358979323846264 * k / n);
+    plan->twiddles_im[k] = sin(-2.0 * 3.14159265358979323846264 * k / n);
+  }
+  return plan;
+}
+
+void fft_real_plan_destroy(RealFFTPlan* plan)
+{
+  if (!plan) return;
+  fft_plan_destroy(plan->half);
+  free(plan->twiddles_re);
+  free(plan->twiddles_im);
+  free(plan);
+  return;
+}
+
+// The Fast Furier Transform of the [plan->n] real samples of
+// [in_frames], saving the magnitude of frequencies 0 to n/2 included
+// in [out_frequencies], which must hold n/2 + 1 values. The others
+// mirror these for a real input.
+void fft_real(RealFFTPlan* plan, const float* in_frames, float *out_frequencies)
+{
+  FFTPlan* half = plan->half;
+  const unsigned int m = half->n;
+  float* zr = half->re;
+  float* zi = half->im;
+
+  // z[k] = x[2k] + i x[2k + 1], loaded in bit-reversed order
+  for (unsigned int i = 0; i < m; ++i)
+  {
+    unsigned int j = half->bit_reverse[i];
+    zr[i] = in_frames[2 * j];
+    zi[i] = in_frames[2 * j + 1];
+  }
+  fft_passes(half, zr, zi);
+
+  // X[k] = E[k] + W^k O[k], with E and O the spectra of the even and
+  // odd samples: E[k] = (Z[k] + Z*[m - k]) / 2 and
+  // O[k] = -i (Z[k] - Z*[m - k]) / 2. Bins 0 and m only need Z[0].
+  out_frequencies[0] = fabsf(zr[0] + zi[0]);
+  out_frequencies[m] = fabsf(zr[0] - zi[0]);
+  const float* wr = plan->twiddles_re;
+  const float* wi = plan->twiddles_im;
+  for (unsigned int k = 1; k < m; ++k)
+  {
+    float even_re = 0.5f * (zr[k] + zr[m - k]);
+    float even_im = 0.5f * (zi[k] - zi[m - k]);
+    float odd_re = 0.5f * (zi[k] + zi[m - k]);
+    float odd_im = -0.5f * (zr[k] - zr[m - k]);
+    float re = even_re + wr[k] * odd_re - wi[k] * odd_im;
+    float im = even_im + wr[k] * odd_im + wi[k] * odd_re;
+    out_frequencies[k] = sqrtf(re * re + im * im);
+  }
+  return;
+}
+
+// The spectrum of the [plan->n] real samples of [in_frames]: the real
+// and imaginary parts of frequencies 0 to n/2 included in [out_re]
+// and [out_im], which must hold n/2 + 1 values each
+void fft_real_spectrum(RealFFTPlan* plan, const float* in_frames,
+                       float* out_re, float* out_im)
+{
+  FFTPlan* half = plan->half;
+  const unsigned int m = half->n;
+  float* zr = half->re;
+  float* zi = half->im;
+
+  for (unsigned int i = 0; i < m; ++i)
+  {
+    unsigned int j = half->bit_reverse[i];
+    zr[i] = in_frames[2 * j];
+    zi[i] = in_frames[2 * j + 1];
+  }
+  fft_passes(half, zr, zi);
+
+  // Same separation as fft_real()
+  out_re[0] = zr[0] + zi[0];
+  out_im[0] = 0.0f;
+  out_re[m] = zr[0] - zi[0];
+  out_im[m] = 0.0f;
+  const float* wr = plan->twiddles_re;
+  const float* wi = plan->twiddles_im;
+  for (unsigned int k = 1; k < m; ++k)
+  {
+    float even_re = 0.5f * (zr[k] + zr[m - k]);
+    float even_im = 0.5f * (zi[k] - zi[m - k]);
+    float odd_re = 0.5f * (zi[k] + zi[m - k]);
+    float odd_im = -0.5f * (zr[k] - zr[m - k]);
+    out_re[k] = even_re + wr[k] * odd_re - wi[k] * odd_im;
+    out_im[k] = even_im + wr[k] * odd_im + wi[k] * odd_re;
+  }
+  return;
+}
+
+// Inverse of fft_real_spectrum(): the [plan->n] real samples of the
+// spectrum [in_re], [in_im] of frequencies 0 to n/2, in [out_frames]
+void fft_real_inverse(RealFFTPlan* plan, const float* in_re, const float* in_im,
+                      float* out_frames)
+{
+  FFTPlan* half = plan->half;
+  const unsigned int m = half->n;
+  float* zr = half->re;
+  float* zi = half->im;
 
-  // Split
-  float even[window / 2], odd[window / 2];
-  for (unsigned int i = 0; i < window / 2; i++)
+  // Z[k] = E[k] + i O[k], with E[k] = (X[k] + X*[m - k]) / 2 and
+  // O[k] = (X[k] - X*[m - k]) W^-k / 2, whose inverse holds the even
+  // samples in its real part and the odd ones in its imaginary part.
+  // The inverse is a forward FFT with real and imaginary parts
+  // swapped, so Z is stored swapped and in bit-reversed order.
+  const float* wr = plan->twiddles_re;
+  const float* wi = plan->twiddles_im;
+  for (unsigned int k = 0; k < m; ++k)
   {
-    even[i] = in_frames[i * 2];
-    odd[i] = in_frames[i * 2 + 1];
+    float even_re = 0.5f * (in_re[k] + in_re[m - k]);
+    float even_im = 0.5f * (in_im[k] - in_im[m - k]);
+    float diff_re = 0.5f * (in_re[k] - in_re[m - k]);
+    float diff_im = 0.5f * (in_im[k] + in_im[m - k]);
+    float odd_re = diff_re * wr[k] + diff_im * wi[k];
+    float odd_im = diff_im * wr[k] - diff_re * wi[k];
+    unsigned int j = half->bit_reverse[k];
+    zr[j] = even_im + odd_re;
+    zi[j] = even_re - odd_im;
   }
-  fft(even, out_frequencies, window / 2);
-  fft(odd, out_frequencies,  window / 2);
+  fft_passes(half, zr, zi);
 
-  // Combine
-  for (unsigned int i = 0; i < window / 2; ++i)
+  const float scale = 1.0f / m;
+  for (unsigned int j = 0; j < m; ++j)
   {
-    complex float twiddle = cexp(-2.0 * I * PI * (float)i / (float)window) * odd[i];
-    out_frequencies[i] = even[i] + twiddle;
-    out_frequencies[i + window / 2] = even[i] - twiddle;
+    out_frames[2 * j] = zi[j] * scale;
+    out_frames[2 * j + 1] = zr[j] * scale;
   }
   return;
 }
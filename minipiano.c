@@ -24,13 +24,64 @@
 //  - p: decrease amplitude (volume)
 //  - z: raise starting frequency by one half tone
 //  - x: decrease starting frequency by one half tone
-//  - 1/2/3/4: switch instrument
+//  - 1/2/3/4/5: switch instrument, 5 is a struck string
+//  - m: switch oscillators between analytic, wavetable and cubic
+//       wavetable
+//  - r: turn the reverb on and off, if there is one
 //  - q: quit
 //
+// Usage
+// -----
+//
+//     minipiano [--rate HZ] [--channels N]
+//               [--tuning equal|just|SCALE.scl]
+//               [--period-frames N | --period-ms N]
+//               [--periods N] [--profile low-latency|conservative]
+//               [--variable-blocks] [--timing] [--latency]
+//               [--voice-parallel] [--workers N]
+//               [--reverb fdn|fdn16|IR.wav] [--reverb-wet LEVEL]
+//               [--reverb-time SECONDS]
+//               [--render SCORE OUTPUT.wav]
+//
+// The period options ask the audio device for a buffer of that many
+// periods of that size; the device may pick something else. Smaller
+// periods mean less latency between a key and its sound, and less
+// time to render each block. --variable-blocks lets the device call
+// back with any number of frames instead of exactly one period, which
+// avoids one period of buffering inside miniaudio.
+// With --latency the buffer the device actually uses is printed at
+// start, and the measured callback sizes and rate on exit.
+//
+// --channels sets the number of output channels, 2 by default. The
+// keys are spread from left to right across the first and the last
+// channel like on a piano.
+// --voice-parallel renders the sine voices of the analytic
+// oscillators several at a time, one per SIMD lane, which is faster
+// with many voices and small periods.
+// --workers starts N threads, pinned to their own cores, that render
+// part of the voices of every block along with the audio thread, see
+// workers.c. Only worth it with many voices playing.
+// --reverb convolves the output with the impulse response in IR.wav,
+// or any other file miniaudio can decode, see convolver.c, or with
+// fdn and fdn16 adds the much cheaper reverb of a feedback delay
+// network of 8 or 16 lines, see fdn.c, which decays by 60 dB in
+// --reverb-time seconds, FDN_TIME by default.
+// --reverb-wet sets the level of either, 0.3 by default.
+// --tuning picks the scale of the keyboard, twelve tone equal
+// temperament by default, see tuning.c for the Scala file format.
+// With --render nothing is played: the note script SCORE is rendered
+// to OUTPUT.wav as fast as possible, see offline.c for its format.
+// With --timing the load of the audio callback is shown in the window
+// and its histogram is printed on exit, see timing.c.
+//
 
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 199309L
 #endif
+// Thread affinity of the workers
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <stdio.h>
 #include <SDL3/SDL_init.h>
@@ -45,11 +96,19 @@
 #include <math.h>
 
 #include "miniaudio.h"
+#include "simd.c"
+#include "tuning.c"
 #include "fft.c"
-
-#ifndef MA_PI
-#define MA_PI      3.14159265358979323846264f
-#endif
+#include "wavetable.c"
+#include "waveguide.c"
+#include "synth.c"
+#include "workers.c"
+#include "convolver.c"
+#include "fdn.c"
+#include "events.c"
+#include "analysis.c"
+#include "offline.c"
+#include "timing.c"
 
 #define WINDOW_NAME   "minipiano"
 #define WINDOW_WIDTH  800
@@ -57,100 +116,394 @@
 #define WINDOW_FLAGS  0
 // TODO: Match FPS to a multiple of the period for better visualization
 #define FPS 10.7
+// Height of the spectrum bars, relative to the magnitude
+#define FREQUENCY_SCALING 0.52
 
 #define MIN(x, y) ((x < y) ? (x) : (y))
 
-typedef enum {
-  SINE = 0,
-  SQUARE,
-  TRIANGLE,
-  SAW,
-} Instrument;
-
 Instrument instrument = SINE;
-
-static double c_frequency = 440.0;
-static double phase = 0.0;
+OscillatorMode mode = OSCILLATOR_WAVETABLE;
+static const char* mode_names[OSCILLATOR_MODE_COUNT] = {
+  "ANALYTIC", "WAVETABLE", "WAVETABLE (cubic)",
+};
+Synth synth;              // owned by the audio thread
+EventQueue events;        // UI thread -> audio thread
+Analysis analysis;        // audio thread -> UI thread
+CallbackTiming timing;    // audio thread -> UI thread
+WorkerPool* workers;      // helpers of the audio thread, may be NULL
+Convolver* convolver;     // owned by the audio thread, may be NULL
+Fdn* fdn;                 // owned by the audio thread, may be NULL
+bool reverb_on = true;    // UI thread -> audio thread
+bool timing_enabled = false;
+
+static double c_frequency = 440.0;  // frequency of the first key
 double frequency;
+Tuning tuning;            // copy of the synth tuning, for display
 double amplitude = 0.2;
 
-void sine_simple(double sample_rate, float* output)
+void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
 {
-  *output = amplitude * sin(phase * 2 * MA_PI);
-  phase += frequency / sample_rate;
-  if (phase >= 1.0) phase -= 1.0;
-}
+  (void) pDevice;
+  (void) pInput;
+  // In playback mode copy data to pOutput. In capture mode read data from pInput. In full-duplex mode, both
+  // pOutput and pInput will be valid and you can move data from pInput into pOutput. Never process more than
+  // frameCount frames.
 
-void tooth(double sample_rate, float* output)
-{
-  if (phase * 2 * MA_PI > 0 && phase * 2 * MA_PI < MA_PI)
+  uint64_t start = event_time_now();
+  float* output = (float*)pOutput;
+  bool audible = synth_render_events(&synth, workers, &events, output, frameCount, start);
+
+  // Bypassed, the reverb costs nothing. It starts again from silence.
+  static bool reverb_was_on = true;
+  bool on = __atomic_load_n(&reverb_on, __ATOMIC_RELAXED);
+  if (on && !reverb_was_on)
   {
-    *output = amplitude;
-  }
-  else {
-    *output = -amplitude;
+    if (convolver) convolver_reset(convolver);
+    if (fdn) fdn_reset(fdn);
   }
-  phase += (2.0 * frequency) / sample_rate;
-  if (phase >= 1.0) phase -= 2.0;
+  reverb_was_on = on;
+  if (on && convolver)
+    audible = convolver_process(convolver, output, frameCount, audible);
+  if (on && fdn)
+    audible = fdn_process(fdn, output, frameCount, audible);
+
+  analysis_write(&analysis, output, frameCount, synth.channels, !audible);
+
+  if (timing_enabled)
+    timing_record(&timing, start, event_time_now(), frameCount, synth.sample_rate);
 }
 
-void triangle(double sample_rate, float* output)
+// Pan of the key of [note], from -1 (first channel) for the first
+// one, a, to 1 (last channel) for the last one, k, twelve half tones
+// above
+static float key_pan(int note)
 {
-  *output = amplitude * phase;
-
-  static bool increasing = false;
-  double df = (2.0 * frequency) / sample_rate;
-  if (!increasing && phase - df < -1.0) increasing = true;
-  if (increasing && phase + df > 1.0) increasing = false;
+  return (note - TUNING_ROOT - 6) / 6.0f;
+}
 
-  if (increasing) {
-    phase += df;
-  } else {
-    phase -= df;
-  }
+// Queue an event for the audio thread, stamped with the current time
+static void send_event(EventType type, int note, float frequency, float amplitude)
+{
+  Event event = {
+    .type       = type,
+    .note       = note,
+    .instrument = instrument,
+    .frequency  = frequency,
+    .amplitude  = amplitude,
+    .pan        = key_pan(note),
+    .time       = event_time_now(),
+  };
+  if (!event_queue_push(&events, &event))
+    fprintf(stderr, "Event queue full, dropping event\n");
 }
 
-void saw(double sample_rate, float* output)
+// Half tones above c_frequency played by [key], or -1 if [key] is not
+// a piano key
+static int key_to_semitone(SDL_Keycode key)
 {
-  *output = amplitude * phase;
-  phase += (2.0 * frequency) / sample_rate;
-  if (phase >= 1.0) phase = -2.0; 
+  switch(key)
+  {
+  case 'a': return 0;  // C
+  case 'w': return 1;  // C#
+  case 's': return 2;  // D
+  case 'e': return 3;  // D#
+  case 'd': return 4;  // E
+  case 'f': return 5;  // F
+  case 't': return 6;  // F#
+  case 'g': return 7;  // G
+  case 'y': return 8;  // G#
+  case 'h': return 9;  // A
+  case 'u': return 10; // A#
+  case 'j': return 11; // B
+  case 'k': return 12; // C
+  default:  return -1;
+  }
 }
 
-void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
+// Handle one input event. Returns false when the program should quit.
+static bool handle_event(const SDL_Event* event)
 {
-  (void) pDevice;
-  (void) pInput;
-  // In playback mode copy data to pOutput. In capture mode read data from pInput. In full-duplex mode, both
-  // pOutput and pInput will be valid and you can move data from pInput into pOutput. Never process more than
-  // frameCount frames.
+  if (SDL_EVENT_QUIT == event->type)
+    return false;
 
-  double sample_rate = pDevice->sampleRate;
-  float* output = (float*)pOutput;
-  for (unsigned int i = 0; i < frameCount; ++i)
+  int semitone = -1;
+  if (SDL_EVENT_KEY_UP == event->type)
   {
-    switch(instrument)
+    semitone = key_to_semitone(event->key.key);
+    if (semitone >= 0)
+      send_event(EVENT_NOTE_OFF, TUNING_ROOT + semitone, 0.0f, 0.0f);
+  }
+  if (SDL_EVENT_KEY_DOWN == event->type && !event->key.repeat)
+  {
+    semitone = key_to_semitone(event->key.key);
+    if (semitone >= 0)
     {
-    case SINE:
-      sine_simple(sample_rate, &output[i]);
+      frequency = tuning.frequency[TUNING_ROOT + semitone];
+      send_event(EVENT_NOTE_ON, TUNING_ROOT + semitone, 0.0f, 1.0f);
+    }
+
+    switch(event->key.key)
+    {
+    case 'q':
+      return false;
+    case 'z':
+      c_frequency *= pow(2, 1 / 12.0);
+      frequency = c_frequency;
+      tuning_update(&tuning, c_frequency, tuning.sample_rate);
+      send_event(EVENT_TUNING, -1, c_frequency, 0.0f);
+      break;
+    case 'x':
+      c_frequency /= pow(2, 1 / 12.0);
+      frequency = c_frequency;
+      tuning_update(&tuning, c_frequency, tuning.sample_rate);
+      send_event(EVENT_TUNING, -1, c_frequency, 0.0f);
+      break;
+    // Select instrument
+    case '1':
+      instrument = SINE;
+      printf("Instrument: SINE\n");
+      break;
+    case '2':
+      instrument = SQUARE;
+      printf("Instrument: SQUARE\n");
+      break;
+    case '3':
+      instrument = TRIANGLE;
+      printf("Instrument: TRIANGLE\n");
       break;
-    case SQUARE:
-      tooth(sample_rate, &output[i]);
+    case '4':
+      instrument = SAW;
+      printf("Instrument: SAW\n");
       break;
-    case TRIANGLE:
-      triangle(sample_rate, &output[i]);
+    case '5':
+      instrument = STRING;
+      printf("Instrument: STRING\n");
       break;
-    case SAW:
-      saw(sample_rate, &output[i]);
+    // Oscillator mode
+    case 'm':
+      mode = (mode + 1) % OSCILLATOR_MODE_COUNT;
+      send_event(EVENT_MODE, mode, 0.0f, 0.0f);
+      printf("Oscillators: %s\n", mode_names[mode]);
+      break;
+    // Amplitude
+    case 'o':
+      amplitude += 0.1;
+      send_event(EVENT_MASTER, -1, 0.0f, amplitude);
+      printf("Amplitude: %f\n", amplitude);
+      break;
+    case 'p':
+      amplitude -= 0.1;
+      if (amplitude < 0.0) amplitude = 0.0;
+      send_event(EVENT_MASTER, -1, 0.0f, amplitude);
+      printf("Amplitude: %f\n", amplitude);
+      break;
+    case 'r':
+      if (convolver || fdn)
+      {
+        bool on = !__atomic_load_n(&reverb_on, __ATOMIC_RELAXED);
+        __atomic_store_n(&reverb_on, on, __ATOMIC_RELAXED);
+        printf("Reverb: %s\n", on ? "ON" : "OFF");
+      }
+      break;
+    default:
       break;
     }
   }
+  return true;
+}
+
+// Create the reverb [name], fdn, fdn16 or the path of an impulse
+// response, for [channels] channels at [sample_rate]. Prints the
+// error and returns false on failure.
+static bool reverb_create(const char* name, unsigned int sample_rate,
+                          unsigned int channels, float time, float wet)
+{
+  if (strcmp(name, "fdn") == 0 || strcmp(name, "fdn16") == 0)
+  {
+    fdn = fdn_create(name[3] ? 16 : 8, channels, sample_rate, time,
+                     FDN_DAMPING, 1.0f, wet);
+    if (!fdn)
+      fprintf(stderr, "Error creating the reverb\n");
+    return fdn != NULL;
+  }
+  convolver = convolver_load(name, sample_rate, channels, 1.0f, wet);
+  return convolver != NULL;
+}
+
+static void usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [--rate HZ] [--channels N]\n"
+          "          [--tuning equal|just|SCALE.scl]\n"
+          "          [--period-frames N | --period-ms N]\n"
+          "          [--periods N] [--profile low-latency|conservative]\n"
+          "          [--variable-blocks] [--timing] [--latency]\n"
+          "          [--voice-parallel] [--workers N]\n"
+          "          [--reverb fdn|fdn16|IR.wav] [--reverb-wet LEVEL]\n"
+          "          [--reverb-time SECONDS]\n"
+          "          [--render SCORE OUTPUT.wav]\n", name);
+}
 
-  frames_as_frequencies(output, frames, MIN(frameCount, FRAME_COUNT_MAX));
+// Print the buffer [device] got and the latency it adds
+static void print_device_latency(const ma_device* device,
+                                 const ma_device_config* config)
+{
+  double rate = device->playback.internalSampleRate;
+  ma_uint32 period = device->playback.internalPeriodSizeInFrames;
+  ma_uint32 periods = device->playback.internalPeriods;
+  printf("Requested: %u frames or %u ms per period, %u periods, %s\n",
+         config->periodSizeInFrames, config->periodSizeInMilliseconds,
+         config->periods,
+         (config->performanceProfile == ma_performance_profile_low_latency)
+           ? "low latency" : "conservative");
+  printf("Device: %s, %u Hz, %u periods of %u frames (%.2f ms)\n",
+         device->playback.name, device->playback.internalSampleRate,
+         periods, period, period * 1e3 / rate);
+  // Events are applied one callback late, and the device buffer is
+  // played before the new block
+  printf("Buffer latency: %.2f ms, about %.2f ms from key to sound\n",
+         periods * period * 1e3 / rate, (periods + 1) * period * 1e3 / rate);
+  return;
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
+  unsigned int sample_rate = 44100;
+  unsigned int channels = 2;
+  ma_device_config config = ma_device_config_init(ma_device_type_playback);
+  bool print_latency = false;
+  bool voice_parallel = false;
+  unsigned int worker_count = 0;
+  const char* reverb_name = NULL;
+  float reverb_wet = 0.3f;
+  float reverb_time = FDN_TIME;
+  const char* tuning_name = "equal";
+  const char* score_path = NULL;
+  const char* output_path = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+    {
+      sample_rate = (unsigned int) atoi(argv[++i]);
+      if (sample_rate == 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc)
+    {
+      channels = (unsigned int) atoi(argv[++i]);
+      if (channels < 1 || channels > SYNTH_CHANNELS_MAX)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--tuning") == 0 && i + 1 < argc)
+    {
+      tuning_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--period-frames") == 0 && i + 1 < argc)
+    {
+      config.periodSizeInFrames = (ma_uint32) atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--period-ms") == 0 && i + 1 < argc)
+    {
+      config.periodSizeInMilliseconds = (ma_uint32) atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--periods") == 0 && i + 1 < argc)
+    {
+      config.periods = (ma_uint32) atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc
+             && (strcmp(argv[i + 1], "low-latency") == 0
+                 || strcmp(argv[i + 1], "conservative") == 0))
+    {
+      config.performanceProfile = (argv[++i][0] == 'l')
+        ? ma_performance_profile_low_latency
+        : ma_performance_profile_conservative;
+    }
+    else if (strcmp(argv[i], "--variable-blocks") == 0)
+    {
+      config.noFixedSizedCallback = MA_TRUE;
+    }
+    else if (strcmp(argv[i], "--voice-parallel") == 0)
+    {
+      voice_parallel = true;
+    }
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+    {
+      int count = atoi(argv[++i]);
+      if (count < 0 || count > WORKERS_MAX)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      worker_count = (unsigned int) count;
+    }
+    else if (strcmp(argv[i], "--reverb") == 0 && i + 1 < argc)
+    {
+      reverb_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--reverb-wet") == 0 && i + 1 < argc)
+    {
+      reverb_wet = (float) atof(argv[++i]);
+      if (reverb_wet < 0.0f)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--reverb-time") == 0 && i + 1 < argc)
+    {
+      reverb_time = (float) atof(argv[++i]);
+      if (reverb_time <= 0.0f)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--timing") == 0)
+    {
+      timing_enabled = true;
+    }
+    else if (strcmp(argv[i], "--latency") == 0)
+    {
+      print_latency = true;
+      timing_enabled = true;
+    }
+    else if (strcmp(argv[i], "--render") == 0 && i + 2 < argc)
+    {
+      score_path = argv[++i];
+      output_path = argv[++i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (strcmp(tuning_name, "equal") == 0)
+    tuning_equal(&tuning);
+  else if (strcmp(tuning_name, "just") == 0)
+    tuning_just(&tuning);
+  else if (!tuning_load_scala(&tuning, tuning_name))
+    return 1;
+
+  if (score_path)
+  {
+    if (reverb_name && !reverb_create(reverb_name, sample_rate, channels,
+                                      reverb_time, reverb_wet))
+      return 1;
+    int ret = offline_render(score_path, output_path, sample_rate, channels,
+                             &tuning, convolver, fdn);
+    convolver_destroy(convolver);
+    fdn_destroy(fdn);
+    return ret;
+  }
+
   if (!SDL_Init(SDL_INIT_VIDEO))
   {
     fprintf(stderr, "Error initializing SDL: %s\n", SDL_GetError());
@@ -170,10 +523,9 @@ int main(void)
     return 1;
   }
 
-  ma_device_config config = ma_device_config_init(ma_device_type_playback);
   config.playback.format   = ma_format_f32;   // [-1, 1]. Set to ma_format_unknown to use the device's native format.
-  config.playback.channels = 1;               // Set to 0 to use the device's native channel count.
-  config.sampleRate        = 44100;           // Set to 0 to use the device's native sample rate.
+  config.playback.channels = channels;        // Set to 0 to use the device's native channel count.
+  config.sampleRate        = sample_rate;     // Set to 0 to use the device's native sample rate.
   config.dataCallback      = data_callback;   // This function will be called when miniaudio needs more data.
   config.pUserData         = NULL;   // Can be accessed from the device object (device.pUserData).
 
@@ -181,161 +533,145 @@ int main(void)
   if (ma_device_init(NULL, &config, &device) != MA_SUCCESS) {
     return -1;  // Failed to initialize the device.
   }
+  if (print_latency)
+    print_device_latency(&device, &config);
 
   frequency = c_frequency;
+  synth_init(&synth, device.sampleRate);
+  synth_set_channels(&synth, device.playback.channels);
+  synth.master = amplitude;
+  synth.voice_parallel = voice_parallel;
+  synth_set_scale(&synth, &tuning);
+  synth_tune(&synth, c_frequency);
+  tuning_update(&tuning, c_frequency, device.sampleRate);
+  event_queue_init(&events);
+  analysis_init(&analysis);
+  timing_init(&timing);
+
+  RealFFTPlan* fft_plan = fft_real_plan_create(ANALYSIS_WINDOW);
+  if (!fft_plan)
+  {
+    fprintf(stderr, "Error creating FFT plan\n");
+    ma_device_uninit(&device);
+    return 1;
+  }
+
+  if (reverb_name && !reverb_create(reverb_name, device.sampleRate,
+                                    device.playback.channels, reverb_time, reverb_wet))
+  {
+    fft_real_plan_destroy(fft_plan);
+    ma_device_uninit(&device);
+    return 1;
+  }
+
+  if (worker_count > 0)
+  {
+    workers = worker_pool_create(worker_count);
+    if (!workers)
+      fprintf(stderr, "Error starting %u workers, rendering on the audio thread only\n",
+              worker_count);
+  }
 
   ma_device_start(&device);     // The device is sleeping by default so you'll need to start it manually.
 
-  double delta_time = 0.0;
+  const uint64_t frame_period = 1e9 / FPS;
+  uint64_t next_frame = event_time_now();
   while(1)
   {
-    struct timespec frame_start;
-    clock_gettime(CLOCK_MONOTONIC, &frame_start);
-
-    if (SDL_PollEvent(&event))
+    // Sleep until the next event or the next frame, whichever comes
+    // first, then handle every pending event before drawing
+    uint64_t now = event_time_now();
+    Sint32 timeout = (next_frame > now) ? (next_frame - now + 999999) / 1000000 : 0;
+    bool has_event = SDL_WaitEventTimeout(&event, timeout);
+    while (has_event)
     {
-      if (SDL_EVENT_KEY_DOWN == event.type)
-      {
-        switch(event.key.key)
-        {
-        case 'q':
-          goto cleanup;
-        case 'z':
-          c_frequency *= pow(2, 1 / 12.0);
-          frequency = c_frequency;
-          break;
-        case 'x':
-          c_frequency /= pow(2, 1 / 12.0);
-          frequency = c_frequency;
-          break;
-          // Piano keys
-        case 'a': // C
-          frequency = c_frequency;
-          break;
-        case 'w': // C#
-          frequency = c_frequency * pow(2, 1.0 / 12);
-          break;
-        case 's': // D
-          frequency = c_frequency * pow(2, 2.0 / 12);
-          break;
-        case 'e': // D#
-          frequency = c_frequency * pow(2, 3.0 / 12);
-          break; 
-        case 'd': // E
-          frequency = c_frequency * pow(2, 4.0 / 12);
-          break;
-        case 'f': // F
-          frequency = c_frequency * pow(2, 5.0 / 12);
-          break;
-        case 't': // F#
-          frequency = c_frequency * pow(2, 6.0 / 12);
-          break;
-        case 'g': // G
-          frequency = c_frequency * pow(2, 7.0 / 12);
-          break;
-        case 'y': // G#
-          frequency = c_frequency * pow(2, 8.0 / 12);
-          break;
-        case 'h': // A
-          frequency = c_frequency * pow(2, 9.0 / 12);
-          break;
-        case 'u': // A#
-          frequency = c_frequency * pow(2, 10.0 / 12);
-          break;
-        case 'j': // B
-          frequency = c_frequency * pow(2, 11.0 / 12);
-          break;
-        case 'k': // C
-          frequency = c_frequency * pow(2, 12.0 / 12);
-          break;
-        // Select instrument
-        case '1':
-          instrument = SINE;
-          printf("Instrument: SINE\n");
-          break;
-        case '2':
-          instrument = SQUARE;
-          printf("Instrument: SQUARE\n");
-          break;
-        case '3':
-          instrument = TRIANGLE;
-          printf("Instrument: TRIANGLE\n");
-          break;
-        case '4':
-          instrument = SAW;
-          printf("Instrument: SAW\n");
-          break;
-        // Amplitude
-        case 'o':
-          amplitude += 0.1;
-          printf("Amplitude: %f\n", amplitude);
-          break;
-        case 'p':
-          amplitude -= 0.1;
-          if (amplitude < 0.0) amplitude = 0.0;
-          printf("Amplitude: %f\n", amplitude);
-          break;
-        default:
-          break;
-        }
-      }
+      if (!handle_event(&event))
+        goto cleanup;
+      has_event = SDL_PollEvent(&event);
     }
 
-    if (delta_time > 1 / FPS) // Render frame
-    {
-      delta_time = 0;
+    now = event_time_now();
+    if (now < next_frame)
+      continue;
+    next_frame += frame_period;
+    if (next_frame <= now)      // skip the frames we were too late for
+      next_frame = now + frame_period;
 
-      // Render frame...
-      
-      SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-      if (!SDL_RenderClear(renderer))
-      {
-        fprintf(stderr, "Error Clearing SDL Window: %s\n", SDL_GetError());    
-        goto cleanup;
-      }
-      SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-      
-      char frequency_str[100] = {0};
-      sprintf(frequency_str, "%f Hz", frequency);
-    
-      SDL_SetRenderScale(renderer, 4.0f, 4.0f);
-      SDL_RenderDebugText(renderer, 55, 10, frequency_str);
-      SDL_SetRenderScale(renderer, 1.0f, 1.0f);
+    // Render frame...
 
-      fft(frames, frequencies, FRAME_COUNT_MAX);
-      //frames_as_frequencies(frames, frequencies, FRAME_COUNT_MAX);
-    
-      SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);    
-      for (unsigned int i = 0; i < FRAME_COUNT_MAX / 2; ++i)
-      {
-        if (frequencies[i] <= 0.0) continue;
-        SDL_FRect rect = (SDL_FRect){
-          .x = i * WINDOW_WIDTH / FRAME_COUNT_MAX * 2,
-          .y = WINDOW_HEIGHT/2,
-          .w = WINDOW_WIDTH / FRAME_COUNT_MAX,
-          .h = WINDOW_HEIGHT * frequencies[i] / 2.0 * FREQUENCY_SCALING,
-        };
-        SDL_RenderFillRect(renderer, &rect);
-        rect.h *= -1; // Mirror the spectrum
-        SDL_RenderFillRect(renderer, &rect);
-      }
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    if (!SDL_RenderClear(renderer))
+    {
+      fprintf(stderr, "Error Clearing SDL Window: %s\n", SDL_GetError());    
+      goto cleanup;
     }
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
     
+    char frequency_str[100] = {0};
+    sprintf(frequency_str, "%f Hz", frequency);
+  
+    SDL_SetRenderScale(renderer, 4.0f, 4.0f);
+    SDL_RenderDebugText(renderer, 55, 10, frequency_str);
+    SDL_SetRenderScale(renderer, 1.0f, 1.0f);
+
+    if (timing_enabled)
+    {
+      CallbackTiming snapshot;
+      timing_read(&timing, &snapshot);
+      char timing_str[100] = {0};
+      sprintf(timing_str, "load p50 %3.0f%%  p99 %3.0f%%  max %.2f ms  late %llu",
+              timing_percentile(&snapshot, 0.5) * 100,
+              timing_percentile(&snapshot, 0.99) * 100,
+              snapshot.max_ns / 1e6, (unsigned long long) snapshot.late);
+      SDL_RenderDebugText(renderer, 10, WINDOW_HEIGHT - 20, timing_str);
+    }
+
+    float frames[ANALYSIS_WINDOW];        // latest audio samples
+    float frequencies[ANALYSIS_WINDOW];   // filled by FFT
+    if (analysis_silent(&analysis, ANALYSIS_WINDOW))
+    {
+      memset(frequencies, 0, sizeof(frequencies));
+    }
+    else
+    {
+      analysis_read(&analysis, frames, ANALYSIS_WINDOW);
+      fft_real(fft_plan, frames, frequencies);
+    }
+  
+    SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);    
+    for (unsigned int i = 0; i < ANALYSIS_WINDOW / 2; ++i)
+    {
+      if (frequencies[i] <= 0.0) continue;
+      SDL_FRect rect = (SDL_FRect){
+        .x = i * WINDOW_WIDTH / ANALYSIS_WINDOW * 2,
+        .y = WINDOW_HEIGHT/2,
+        .w = WINDOW_WIDTH / ANALYSIS_WINDOW,
+        .h = WINDOW_HEIGHT * frequencies[i] / 2.0 * FREQUENCY_SCALING,
+      };
+      SDL_RenderFillRect(renderer, &rect);
+      rect.h *= -1; // Mirror the spectrum
+      SDL_RenderFillRect(renderer, &rect);
+    }
+
     if (!SDL_RenderPresent(renderer))
     {
       fprintf(stderr, "Error Rendering SDL Window: %s\n", SDL_GetError());    
       goto cleanup;
     }
-
-    SDL_Delay(16);
-    struct timespec frame_end;
-    clock_gettime(CLOCK_MONOTONIC, &frame_end);
-    delta_time += (frame_end.tv_sec - frame_start.tv_sec)
-      + (frame_end.tv_nsec - frame_start.tv_nsec) / 1e9;
   }
 
  cleanup:
   ma_device_uninit(&device);
+  worker_pool_destroy(workers);
+  convolver_destroy(convolver);
+  fdn_destroy(fdn);
+  if (timing_enabled)
+  {
+    CallbackTiming snapshot;
+    timing_read(&timing, &snapshot);
+    timing_print(&snapshot, stdout);
+  }
+  fft_real_plan_destroy(fft_plan);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
@@ -0,0 +1,330 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// offline.c
+// =========
+//
+// Headless rendering of a note script to a WAV file in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// A score is a text file with one event per line, sorted by time:
+//
+//     # seconds  command     arguments
+//     0.0        instrument  square
+//     0.0        on          0
+//     0.5        on          4  0.5
+//     1.0        off         0
+//     1.0        off         4
+//     2.0        end
+//
+// Commands:
+//
+//  - on NOTE [AMPLITUDE [PAN]]: start the note NOTE steps of the scale
+//    above the base note, at PAN from -1 (first channel) to 1 (last
+//    channel), 0 by default
+//  - off NOTE: release the note NOTE steps above the base note
+//  - base HZ: frequency of the base note, 440 by default
+//  - instrument sine|square|triangle|saw|string: instrument of the
+//    next notes
+//  - mode analytic|wavetable|cubic: oscillator mode
+//  - volume AMPLITUDE: master volume, OFFLINE_VOLUME by default
+//  - end: stop rendering, otherwise it stops OFFLINE_TAIL seconds
+//    after the last event
+//
+// The events go through the same queue and synth_render_events() as
+// the audio callback, stamped on a virtual clock that advances one
+// block at a time, so they land on the exact frame of their time and
+// the output does not depend on the speed of the machine.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define OFFLINE_BLOCK_SIZE 512
+// Seconds rendered after the last event when the score has no end
+#define OFFLINE_TAIL 1.0
+// Master volume at the start, the same as the interactive default
+#define OFFLINE_VOLUME 0.2f
+// Frequency of the base note at the start
+#define OFFLINE_BASE 440.0
+
+typedef struct {
+  uint64_t frame;
+  Event    event;
+} ScoreEvent;
+
+typedef struct {
+  ScoreEvent*  events;
+  unsigned int count;
+  unsigned int capacity;
+  uint64_t     end;           // frames to render
+} Score;
+
+// Virtual time of [frame], in nanoseconds
+static inline uint64_t offline_time(double frame, double sample_rate)
+{
+  return (uint64_t)(frame * 1e9 / sample_rate);
+}
+
+static bool score_append(Score* score, const ScoreEvent* event)
+{
+  if (score->count == score->capacity)
+  {
+    unsigned int capacity = score->capacity ? score->capacity * 2 : 64;
+    ScoreEvent* events = realloc(score->events, capacity * sizeof(ScoreEvent));
+    if (!events)
+      return false;
+    score->events = events;
+    score->capacity = capacity;
+  }
+  score->events[score->count++] = *event;
+  return true;
+}
+
+static int score_instrument(const char* name)
+{
+  static const char* names[INSTRUMENT_COUNT] = {
+    [SINE] = "sine", [SQUARE] = "square",
+    [TRIANGLE] = "triangle", [SAW] = "saw",
+    [STRING] = "string",
+  };
+  for (int i = 0; i < INSTRUMENT_COUNT; ++i)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+static int score_mode(const char* name)
+{
+  static const char* names[OSCILLATOR_MODE_COUNT] = {
+    [OSCILLATOR_ANALYTIC] = "analytic",
+    [OSCILLATOR_WAVETABLE] = "wavetable",
+    [OSCILLATOR_WAVETABLE_CUBIC] = "cubic",
+  };
+  for (int i = 0; i < OSCILLATOR_MODE_COUNT; ++i)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+void score_free(Score* score)
+{
+  free(score->events);
+  memset(score, 0, sizeof(*score));
+  return;
+}
+
+// Parse the score at [path] with event times in frames of
+// [sample_rate]. Prints the first error to stderr and returns false.
+bool score_load(Score* score, const char* path, double sample_rate)
+{
+  memset(score, 0, sizeof(*score));
+  FILE* file = fopen(path, "r");
+  if (!file)
+  {
+    fprintf(stderr, "Error opening score %s\n", path);
+    return false;
+  }
+
+  Instrument instrument = SINE;
+  double time = 0.0, last_time = 0.0;
+  bool has_end = false;
+  unsigned int line_number = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file))
+  {
+    ++line_number;
+    char* comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char command[16], argument[16];
+    double value = 1.0, pan = 0.0;
+    int fields = sscanf(line, "%lf %15s %15s %lf %lf", &time, command, argument,
+                        &value, &pan);
+    if (fields <= 0)
+      continue;                 // empty line
+    if (fields < 2 || time < last_time || has_end)
+    {
+      fprintf(stderr, "%s:%u: %s\n", path, line_number,
+              (fields < 2) ? "expected a time and a command" :
+              has_end ? "event after end" : "time goes backwards");
+      goto error;
+    }
+    last_time = time;
+
+    ScoreEvent event = {
+      .frame = (uint64_t) llround(time * sample_rate),
+      .event = { .instrument = instrument },
+    };
+    event.event.time = offline_time(event.frame + 0.5, sample_rate);
+
+    bool valid = true;
+    if (strcmp(command, "on") == 0 || strcmp(command, "off") == 0)
+    {
+      char* end;
+      long note = (fields >= 3) ? strtol(argument, &end, 10) : 0;
+      valid = fields >= 3 && *end == '\0'
+        && note >= -TUNING_ROOT && note < TUNING_NOTES - TUNING_ROOT;
+      event.event.type = (command[1] == 'n') ? EVENT_NOTE_ON : EVENT_NOTE_OFF;
+      event.event.note = TUNING_ROOT + (int) note;
+      event.event.amplitude = value;
+      event.event.pan = pan;
+    }
+    else if (strcmp(command, "volume") == 0 || strcmp(command, "base") == 0)
+    {
+      valid = fields >= 3 && sscanf(argument, "%lf", &value) == 1 && value >= 0.0;
+      event.event.type = (command[0] == 'b') ? EVENT_TUNING : EVENT_MASTER;
+      event.event.frequency = value;
+      event.event.amplitude = value;
+    }
+    else if (strcmp(command, "instrument") == 0)
+    {
+      int index = (fields >= 3) ? score_instrument(argument) : -1;
+      valid = index >= 0;
+      if (valid)
+      {
+        instrument = (Instrument) index;
+        continue;
+      }
+    }
+    else if (strcmp(command, "mode") == 0)
+    {
+      int index = (fields >= 3) ? score_mode(argument) : -1;
+      valid = index >= 0;
+      event.event.type = EVENT_MODE;
+      event.event.note = index;
+    }
+    else if (strcmp(command, "end") == 0)
+    {
+      score->end = event.frame;
+      has_end = true;
+      continue;
+    }
+    else
+    {
+      fprintf(stderr, "%s:%u: unknown command '%s'\n", path, line_number, command);
+      goto error;
+    }
+
+    if (!valid)
+    {
+      fprintf(stderr, "%s:%u: bad argument for '%s'\n", path, line_number, command);
+      goto error;
+    }
+    if (!score_append(score, &event))
+    {
+      fprintf(stderr, "Out of memory loading score\n");
+      goto error;
+    }
+  }
+
+  if (!has_end)
+    score->end = (uint64_t) llround((last_time + OFFLINE_TAIL) * sample_rate);
+  fclose(file);
+  return true;
+
+ error:
+  fclose(file);
+  score_free(score);
+  return false;
+}
+
+// Render the score at [score_path] to the WAV file [output_path], as
+// 32 bit float at [sample_rate] with [channels] channels, with the
+// scale of [scale], through the reverbs [convolver] and [fdn] unless
+// they are NULL. Returns the exit code of the program.
+int offline_render(const char* score_path, const char* output_path,
+                   unsigned int sample_rate, unsigned int channels,
+                   const Tuning* scale, Convolver* convolver, Fdn* fdn)
+{
+  Score score;
+  if (!score_load(&score, score_path, sample_rate))
+    return 1;
+
+  Synth* synth = malloc(sizeof(Synth));
+  EventQueue* queue = malloc(sizeof(EventQueue));
+  if (!synth || !queue)
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(synth);
+    free(queue);
+    score_free(&score);
+    return 1;
+  }
+  synth_init(synth, sample_rate);
+  synth_set_channels(synth, channels);
+  synth->master = OFFLINE_VOLUME;
+  synth_set_scale(synth, scale);
+  synth_tune(synth, OFFLINE_BASE);
+  event_queue_init(queue);
+
+  ma_encoder encoder;
+  ma_encoder_config config =
+    ma_encoder_config_init(ma_encoding_format_wav, ma_format_f32,
+                           synth->channels, sample_rate);
+  if (ma_encoder_init_file(output_path, &config, &encoder) != MA_SUCCESS)
+  {
+    fprintf(stderr, "Error opening %s for writing\n", output_path);
+    free(synth);
+    free(queue);
+    score_free(&score);
+    return 1;
+  }
+
+  uint64_t start = event_time_now();
+  float block[OFFLINE_BLOCK_SIZE * SYNTH_CHANNELS_MAX];
+  unsigned int next = 0;
+  int ret = 0;
+  for (uint64_t frame = 0; frame < score.end; )
+  {
+    uint64_t frame_count = score.end - frame;
+    if (frame_count > OFFLINE_BLOCK_SIZE) frame_count = OFFLINE_BLOCK_SIZE;
+
+    // Queue every event of this block. If the queue fills up the block
+    // stops at the first event left out, which goes in the next one.
+    while (next < score.count && score.events[next].frame < frame + frame_count)
+    {
+      if (!event_queue_push(queue, &score.events[next].event))
+      {
+        frame_count = score.events[next].frame - frame;
+        break;
+      }
+      ++next;
+    }
+
+    // The queue measures offsets from the time passed to the previous
+    // call, so each call passes the time of the end of its block
+    bool audible = synth_render_events(synth, NULL, queue, block, frame_count,
+                                       offline_time(frame + frame_count, sample_rate));
+    if (convolver)
+      audible = convolver_process(convolver, block, frame_count, audible);
+    if (fdn)
+      audible = fdn_process(fdn, block, frame_count, audible);
+    if (ma_encoder_write_pcm_frames(&encoder, block, frame_count, NULL) != MA_SUCCESS)
+    {
+      fprintf(stderr, "Error writing %s\n", output_path);
+      ret = 1;
+      break;
+    }
+    frame += frame_count;
+  }
+
+  double elapsed = (event_time_now() - start + 1) / 1e9;
+  double seconds = (double) score.end / sample_rate;
+  if (ret == 0)
+    printf("Rendered %.2f s of audio to %s in %.3f s (%.0fx realtime)\n",
+           seconds, output_path, elapsed, seconds / elapsed);
+
+  ma_encoder_uninit(&encoder);
+  free(synth);
+  free(queue);
+  score_free(&score);
+  return ret;
+}
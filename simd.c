@@ -0,0 +1,392 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// simd.c
+// ======
+//
+// Runtime SIMD detection and a vectorized sine oscillator in C99, with
+// SSE2, AVX2 and NEON paths and a scalar fallback.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// Phases are 32 bit unsigned fractions of a turn: 2^32 is one whole
+// period, so wrapping around is the free overflow of an unsigned add,
+// the phase of frame i of a block is exactly phase + i * increment and
+// an oscillator never drifts however long it plays. The top bits of
+// the phase index a wavetable directly.
+//
+// The sine is a degree 9 odd minimax polynomial of the phase. The
+// phase, read as a signed integer, is a turn in [-0.5, 0.5), which is
+// folded to [-0.25, 0.25] using sin(pi - x) = sin(x), where the
+// polynomial is accurate to about 3e-9, well below float precision.
+// All paths evaluate the same steps; only AVX2 differs in the last bit
+// because it uses fused multiply-adds.
+//
+// sine_block() vectorizes one oscillator along time. sine_voices()
+// renders one oscillator per lane instead, for many voices playing
+// short blocks: phases, increments and linear envelopes are lane
+// vectors, and the lanes of each frame are summed horizontally into
+// the output, a tile of frames at a time.
+//
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Phase increment per frame of [frequency] Hz at [sample_rate]
+static inline uint32_t phase_increment(double frequency, double sample_rate)
+{
+  double turns = frequency / sample_rate;
+  return (uint32_t)(uint64_t) llround((turns - floor(turns)) * 4294967296.0);
+}
+
+// [phase] as a float in [0, 1). Only the top 24 bits are kept, as
+// many as a float holds, so the result never rounds up to 1.
+static inline float phase_to_float(uint32_t phase)
+{
+  return (float)(int32_t)(phase >> 8) * 0x1p-24f;
+}
+
+// Coefficients of sin(2 * pi * y) for y in [-0.25, 0.25]
+#define SINE_C1  6.283185160e+00f
+#define SINE_C3 -4.134165503e+01f
+#define SINE_C5  8.160100383e+01f
+#define SINE_C7 -7.654977730e+01f
+#define SINE_C9  3.953667120e+01f
+
+// Writes the sine of phase + i * increment to [output] for every
+// frame i
+typedef void (*SineKernel)(float* restrict output, unsigned int frame_count,
+                           uint32_t phase, uint32_t increment);
+
+// Most voices a SineVoicesKernel renders at once
+#define SIMD_LANES_MAX 8
+
+// For every frame i adds the sum over the voices v of
+//   (level[v] + (i + 1) * slope[v]) * sine(phase[v] + i * increment[v])
+// to [output], and the same sum with [next_level] and [next_slope] to
+// [next_output] unless it is NULL. Renders sine_voices_lanes voices.
+typedef void (*SineVoicesKernel)(float* restrict output,
+                                 float* restrict next_output,
+                                 unsigned int frame_count,
+                                 const uint32_t* phase, const uint32_t* increment,
+                                 const float* level, const float* slope,
+                                 const float* next_level, const float* next_slope);
+
+static inline float sine_poly(uint32_t phase)
+{
+  float x = (float)(int32_t) phase * 0x1p-32f;    // [-0.5, 0.5]
+  float a = 0.25f - fabsf(fabsf(x) - 0.25f);      // [0, 0.25]
+  float y = copysignf(a, x);
+  float z = y * y;
+  return y * (SINE_C1 + z * (SINE_C3 + z * (SINE_C5 + z * (SINE_C7 + z * SINE_C9))));
+}
+
+void sine_block_scalar(float* restrict output, unsigned int frame_count,
+                       uint32_t phase, uint32_t increment)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+    output[i] = sine_poly(phase + i * increment);
+  return;
+}
+
+// Frames [first] to [frame_count] of a SineVoicesKernel for [lanes]
+// voices, one voice at a time
+static inline void sine_voices_tail(float* restrict output,
+                                    float* restrict next_output,
+                                    unsigned int first, unsigned int frame_count,
+                                    unsigned int lanes,
+                                    const uint32_t* phase, const uint32_t* increment,
+                                    const float* level, const float* slope,
+                                    const float* next_level, const float* next_slope)
+{
+  for (unsigned int v = 0; v < lanes; ++v)
+  {
+    for (unsigned int i = first; i < frame_count; ++i)
+    {
+      float sine = sine_poly(phase[v] + i * increment[v]);
+      output[i] += (level[v] + (i + 1) * slope[v]) * sine;
+      if (next_output)
+        next_output[i] += (next_level[v] + (i + 1) * next_slope[v]) * sine;
+    }
+  }
+  return;
+}
+
+void sine_voices_scalar(float* restrict output, float* restrict next_output,
+                        unsigned int frame_count,
+                        const uint32_t* phase, const uint32_t* increment,
+                        const float* level, const float* slope,
+                        const float* next_level, const float* next_slope)
+{
+  sine_voices_tail(output, next_output, 0, frame_count, 4, phase, increment,
+                   level, slope, next_level, next_slope);
+  return;
+}
+
+#ifdef SIMD_X86
+
+// Sine of the phase in each lane of [p]
+static inline __m128 sine_sse2(__m128i p)
+{
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  const __m128 sign    = _mm_set1_ps(-0.0f);
+  __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(p), _mm_set1_ps(0x1p-32f));
+
+  __m128 x_sign = _mm_and_ps(x, sign);
+  __m128 a = _mm_sub_ps(quarter, _mm_andnot_ps(sign, _mm_sub_ps(_mm_andnot_ps(sign, x), quarter)));
+  __m128 y = _mm_or_ps(a, x_sign);
+  __m128 z = _mm_mul_ps(y, y);
+
+  __m128 r = _mm_add_ps(_mm_set1_ps(SINE_C7), _mm_mul_ps(z, _mm_set1_ps(SINE_C9)));
+  r = _mm_add_ps(_mm_set1_ps(SINE_C5), _mm_mul_ps(z, r));
+  r = _mm_add_ps(_mm_set1_ps(SINE_C3), _mm_mul_ps(z, r));
+  r = _mm_add_ps(_mm_set1_ps(SINE_C1), _mm_mul_ps(z, r));
+  return _mm_mul_ps(y, r);
+}
+
+void sine_block_sse2(float* restrict output, unsigned int frame_count,
+                     uint32_t phase, uint32_t increment)
+{
+  __m128i p = _mm_setr_epi32((int32_t) phase, (int32_t)(phase + increment),
+                             (int32_t)(phase + 2 * increment),
+                             (int32_t)(phase + 3 * increment));
+  const __m128i step = _mm_set1_epi32((int32_t)(4 * increment));
+
+  unsigned int i = 0;
+  for (; i + 4 <= frame_count; i += 4)
+  {
+    _mm_storeu_ps(output + i, sine_sse2(p));
+    p = _mm_add_epi32(p, step);
+  }
+  for (; i < frame_count; ++i)
+    output[i] = sine_poly(phase + i * increment);
+  return;
+}
+
+// Four voices, four frames at a time. The four frames of lanes are
+// transposed to four lanes of frames and added together.
+void sine_voices_sse2(float* restrict output, float* restrict next_output,
+                      unsigned int frame_count,
+                      const uint32_t* phase, const uint32_t* increment,
+                      const float* level, const float* slope,
+                      const float* next_level, const float* next_slope)
+{
+  __m128i p = _mm_loadu_si128((const __m128i*) phase);
+  const __m128i step = _mm_loadu_si128((const __m128i*) increment);
+  const __m128 l0 = _mm_loadu_ps(level), dl = _mm_loadu_ps(slope);
+  const __m128 n0 = _mm_loadu_ps(next_level), dn = _mm_loadu_ps(next_slope);
+
+  unsigned int i = 0;
+  for (; i + 4 <= frame_count; i += 4)
+  {
+    __m128 s[4], y[4];
+    for (unsigned int f = 0; f < 4; ++f)
+    {
+      s[f] = sine_sse2(p);
+      p = _mm_add_epi32(p, step);
+      __m128 frame = _mm_set1_ps((float)(i + f + 1));
+      y[f] = _mm_mul_ps(s[f], _mm_add_ps(l0, _mm_mul_ps(frame, dl)));
+    }
+    _MM_TRANSPOSE4_PS(y[0], y[1], y[2], y[3]);
+    __m128 sum = _mm_add_ps(_mm_add_ps(y[0], y[1]), _mm_add_ps(y[2], y[3]));
+    _mm_storeu_ps(output + i, _mm_add_ps(_mm_loadu_ps(output + i), sum));
+
+    if (next_output)
+    {
+      for (unsigned int f = 0; f < 4; ++f)
+      {
+        __m128 frame = _mm_set1_ps((float)(i + f + 1));
+        y[f] = _mm_mul_ps(s[f], _mm_add_ps(n0, _mm_mul_ps(frame, dn)));
+      }
+      _MM_TRANSPOSE4_PS(y[0], y[1], y[2], y[3]);
+      sum = _mm_add_ps(_mm_add_ps(y[0], y[1]), _mm_add_ps(y[2], y[3]));
+      _mm_storeu_ps(next_output + i, _mm_add_ps(_mm_loadu_ps(next_output + i), sum));
+    }
+  }
+  sine_voices_tail(output, next_output, i, frame_count, 4, phase, increment,
+                   level, slope, next_level, next_slope);
+  return;
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 sine_avx2(__m256i p)
+{
+  const __m256 quarter = _mm256_set1_ps(0.25f);
+  const __m256 sign    = _mm256_set1_ps(-0.0f);
+  __m256 x = _mm256_mul_ps(_mm256_cvtepi32_ps(p), _mm256_set1_ps(0x1p-32f));
+
+  __m256 x_sign = _mm256_and_ps(x, sign);
+  __m256 a = _mm256_sub_ps(quarter, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_andnot_ps(sign, x), quarter)));
+  __m256 y = _mm256_or_ps(a, x_sign);
+  __m256 z = _mm256_mul_ps(y, y);
+
+  __m256 r = _mm256_fmadd_ps(z, _mm256_set1_ps(SINE_C9), _mm256_set1_ps(SINE_C7));
+  r = _mm256_fmadd_ps(z, r, _mm256_set1_ps(SINE_C5));
+  r = _mm256_fmadd_ps(z, r, _mm256_set1_ps(SINE_C3));
+  r = _mm256_fmadd_ps(z, r, _mm256_set1_ps(SINE_C1));
+  return _mm256_mul_ps(y, r);
+}
+
+__attribute__((target("avx2,fma")))
+void sine_block_avx2(float* restrict output, unsigned int frame_count,
+                     uint32_t phase, uint32_t increment)
+{
+  __m256i p = _mm256_add_epi32(
+    _mm256_set1_epi32((int32_t) phase),
+    _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                       _mm256_set1_epi32((int32_t) increment)));
+  const __m256i step = _mm256_set1_epi32((int32_t)(8 * increment));
+
+  unsigned int i = 0;
+  for (; i + 8 <= frame_count; i += 8)
+  {
+    _mm256_storeu_ps(output + i, sine_avx2(p));
+    p = _mm256_add_epi32(p, step);
+  }
+  for (; i < frame_count; ++i)
+    output[i] = sine_poly(phase + i * increment);
+  return;
+}
+
+// Sums of the lanes of each of the eight vectors of [y], in order
+__attribute__((target("avx2,fma")))
+static inline __m256 sum_lanes_avx2(const __m256* y)
+{
+  __m256 a = _mm256_hadd_ps(_mm256_hadd_ps(y[0], y[1]), _mm256_hadd_ps(y[2], y[3]));
+  __m256 b = _mm256_hadd_ps(_mm256_hadd_ps(y[4], y[5]), _mm256_hadd_ps(y[6], y[7]));
+  // a holds the sums of the low and high halves of y[0..3], b of y[4..7]
+  return _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20),
+                       _mm256_permute2f128_ps(a, b, 0x31));
+}
+
+// Eight voices, eight frames at a time
+__attribute__((target("avx2,fma")))
+void sine_voices_avx2(float* restrict output, float* restrict next_output,
+                      unsigned int frame_count,
+                      const uint32_t* phase, const uint32_t* increment,
+                      const float* level, const float* slope,
+                      const float* next_level, const float* next_slope)
+{
+  __m256i p = _mm256_loadu_si256((const __m256i*) phase);
+  const __m256i step = _mm256_loadu_si256((const __m256i*) increment);
+  const __m256 l0 = _mm256_loadu_ps(level), dl = _mm256_loadu_ps(slope);
+  const __m256 n0 = _mm256_loadu_ps(next_level), dn = _mm256_loadu_ps(next_slope);
+
+  unsigned int i = 0;
+  for (; i + 8 <= frame_count; i += 8)
+  {
+    __m256 s[8], y[8];
+    for (unsigned int f = 0; f < 8; ++f)
+    {
+      s[f] = sine_avx2(p);
+      p = _mm256_add_epi32(p, step);
+      __m256 frame = _mm256_set1_ps((float)(i + f + 1));
+      y[f] = _mm256_mul_ps(s[f], _mm256_fmadd_ps(frame, dl, l0));
+    }
+    __m256 sum = sum_lanes_avx2(y);
+    _mm256_storeu_ps(output + i, _mm256_add_ps(_mm256_loadu_ps(output + i), sum));
+
+    if (next_output)
+    {
+      for (unsigned int f = 0; f < 8; ++f)
+      {
+        __m256 frame = _mm256_set1_ps((float)(i + f + 1));
+        y[f] = _mm256_mul_ps(s[f], _mm256_fmadd_ps(frame, dn, n0));
+      }
+      sum = sum_lanes_avx2(y);
+      _mm256_storeu_ps(next_output + i, _mm256_add_ps(_mm256_loadu_ps(next_output + i), sum));
+    }
+  }
+  sine_voices_tail(output, next_output, i, frame_count, 8, phase, increment,
+                   level, slope, next_level, next_slope);
+  return;
+}
+
+#endif // SIMD_X86
+
+#ifdef SIMD_NEON
+
+void sine_block_neon(float* restrict output, unsigned int frame_count,
+                     uint32_t phase, uint32_t increment)
+{
+  static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+  const float32x4_t scale   = vdupq_n_f32(0x1p-32f);
+  const float32x4_t quarter = vdupq_n_f32(0.25f);
+  uint32x4_t p = vmlaq_n_u32(vdupq_n_u32(phase), vld1q_u32(lanes), increment);
+  const uint32x4_t step = vdupq_n_u32(4 * increment);
+
+  unsigned int i = 0;
+  for (; i + 4 <= frame_count; i += 4)
+  {
+    float32x4_t x = vmulq_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(p)), scale);
+    p = vaddq_u32(p, step);
+
+    float32x4_t a = vsubq_f32(quarter, vabsq_f32(vsubq_f32(vabsq_f32(x), quarter)));
+    float32x4_t y = vbslq_f32(vcltq_f32(x, vdupq_n_f32(0.0f)), vnegq_f32(a), a);
+    float32x4_t z = vmulq_f32(y, y);
+
+    float32x4_t r = vmlaq_f32(vdupq_n_f32(SINE_C7), z, vdupq_n_f32(SINE_C9));
+    r = vmlaq_f32(vdupq_n_f32(SINE_C5), z, r);
+    r = vmlaq_f32(vdupq_n_f32(SINE_C3), z, r);
+    r = vmlaq_f32(vdupq_n_f32(SINE_C1), z, r);
+    vst1q_f32(output + i, vmulq_f32(y, r));
+  }
+  for (; i < frame_count; ++i)
+    output[i] = sine_poly(phase + i * increment);
+  return;
+}
+
+#endif // SIMD_NEON
+
+typedef enum {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2,
+  SIMD_AVX2,       // with FMA
+  SIMD_NEON,
+} SimdLevel;
+
+// Set by simd_init() to the best instruction set of this CPU and the
+// matching sine kernels. NEON renders voices with the scalar kernel.
+SimdLevel simd_level = SIMD_SCALAR;
+SineKernel sine_block = sine_block_scalar;
+const char* sine_block_name = "scalar";
+SineVoicesKernel sine_voices = sine_voices_scalar;
+unsigned int sine_voices_lanes = 4;
+
+void simd_init(void)
+{
+#if defined(SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    simd_level = SIMD_AVX2;
+    sine_block = sine_block_avx2;
+    sine_block_name = "avx2";
+    sine_voices = sine_voices_avx2;
+    sine_voices_lanes = 8;
+  }
+  else
+  {
+    simd_level = SIMD_SSE2;
+    sine_block = sine_block_sse2;
+    sine_block_name = "sse2";
+    sine_voices = sine_voices_sse2;
+    sine_voices_lanes = 4;
+  }
+#elif defined(SIMD_NEON)
+  simd_level = SIMD_NEON;
+  sine_block = sine_block_neon;
+  sine_block_name = "neon";
+#endif
+  return;
+}
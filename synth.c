@@ -0,0 +1,855 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// synth.c
+// =======
+//
+// Polyphonic voice engine in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// Voices live in a fixed-capacity pool stored as a struct of arrays,
+// so the audio thread walks contiguous memory for each parameter and
+// nothing is ever allocated while rendering. A key down takes a free
+// voice (or steals one), a key up releases it and the voice frees
+// itself once its envelope reaches zero.
+//
+// Every voice has an ADSR envelope made of linear segments. The rates
+// are computed once at note on from the settings of the instrument,
+// and the envelope is written a segment at a time for each block,
+// so the per-frame work is a ramp that the compiler can vectorize.
+//
+// Output has one to SYNTH_CHANNELS_MAX interleaved channels. Every
+// voice has a pan position that places it between two neighbouring
+// channels with constant power. Voices are mixed into one contiguous
+// bus per channel, touching only the two channels they play on, and
+// each chunk is interleaved into the output in a single pass at the
+// end. With one channel voices are mixed straight into the output.
+//
+// STRING voices are a waveguide instead of an oscillator, see
+// waveguide.c. Each voice has its own ring in a pool of the Synth and
+// the envelope only shapes the release: the string decays by itself
+// and frees its voice once it is silent, key held or not.
+//
+// With [voice_parallel] set, analytic sine voices are rendered in
+// packs of sine_voices_lanes, one voice per SIMD lane, instead of one
+// voice at a time vectorized along the block. Short blocks then fill
+// whole vectors however few frames they have, and every pack pays the
+// setup cost of a block once for all its voices.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef SYNTH_PI
+#define SYNTH_PI   3.14159265358979323846264
+#endif
+
+// Maximum number of simultaneous voices
+#ifndef VOICE_COUNT_MAX
+#define VOICE_COUNT_MAX 64
+#endif
+
+// Frames rendered per voice at a time
+#define SYNTH_BLOCK_SIZE 256
+
+// Interleaved output channels
+#define SYNTH_CHANNELS_MAX 8
+
+typedef enum {
+  SINE = 0,
+  SQUARE,
+  TRIANGLE,
+  SAW,
+  STRING,
+  INSTRUMENT_COUNT,
+} Instrument;
+
+typedef enum {
+  VOICE_OFF = 0,  // free, can be allocated
+  VOICE_ATTACK,   // key is down, envelope rising to 1
+  VOICE_DECAY,    // key is down, envelope falling to the sustain level
+  VOICE_SUSTAIN,  // key is down, envelope at the sustain level
+  VOICE_RELEASE,  // key is up, envelope falling to 0
+} VoiceStage;
+
+// How voices compute their waveform
+typedef enum {
+  OSCILLATOR_ANALYTIC = 0,   // evaluate the waveform at every frame
+  OSCILLATOR_WAVETABLE,      // band-limited table, linear interpolation
+  OSCILLATOR_WAVETABLE_CUBIC,// band-limited table, cubic interpolation
+  OSCILLATOR_MODE_COUNT,
+} OscillatorMode;
+
+typedef struct {
+  uint32_t phase;      // fraction of a turn, see simd.c
+  uint32_t increment;  // phase increment per frame
+} Oscillator;
+
+// Envelope settings of an instrument
+typedef struct {
+  float attack;     // seconds from 0 to 1
+  float decay;      // seconds from 1 to [sustain]
+  float sustain;    // level while the key is held, 0 to let it die out
+  float release;    // seconds from 1 to 0 once the key is up
+} Adsr;
+
+static const Adsr default_envelopes[INSTRUMENT_COUNT] = {
+  [SINE]     = { 0.005f, 0.200f, 0.80f, 0.150f },
+  [SQUARE]   = { 0.005f, 0.300f, 0.50f, 0.100f },
+  [TRIANGLE] = { 0.005f, 0.250f, 0.70f, 0.150f },
+  [SAW]      = { 0.010f, 0.300f, 0.60f, 0.120f },
+  [STRING]   = { 0.000f, 0.000f, 1.00f, 0.250f },
+};
+
+typedef struct {
+  double sample_rate;
+  unsigned int channels;          // interleaved output channels
+  float  master;                  // master volume
+  OscillatorMode mode;
+  bool   voice_parallel;          // render sine voices in packs
+  unsigned int clock;             // incremented at every note on
+  Adsr   envelopes[INSTRUMENT_COUNT];
+  Tuning tuning;                  // phase increment of every note
+  // Voice pool, one entry per voice
+  int          note[VOICE_COUNT_MAX];      // id of the key that owns it
+  Instrument   instrument[VOICE_COUNT_MAX];
+  uint32_t     phase[VOICE_COUNT_MAX];
+  uint32_t     increment[VOICE_COUNT_MAX]; // phase increment per frame
+  float        amplitude[VOICE_COUNT_MAX];
+  float        pan[VOICE_COUNT_MAX];       // -1 first channel, 1 last one
+  unsigned int channel[VOICE_COUNT_MAX];   // first channel it plays on
+  float        channel_gain[VOICE_COUNT_MAX]; // gain on [channel]
+  float        next_gain[VOICE_COUNT_MAX];    // gain on [channel] + 1
+  float        envelope[VOICE_COUNT_MAX];  // [0, 1]
+  VoiceStage   stage[VOICE_COUNT_MAX];
+  float        attack_step[VOICE_COUNT_MAX];  // envelope change per frame
+  float        decay_step[VOICE_COUNT_MAX];
+  float        sustain[VOICE_COUNT_MAX];
+  float        release_step[VOICE_COUNT_MAX];
+  unsigned int age[VOICE_COUNT_MAX];       // clock at note on
+  Waveguide    string[VOICE_COUNT_MAX];    // STRING voices only
+
+  // Scratch buffers for one chunk of one voice
+  float wave[SYNTH_BLOCK_SIZE];
+  float envelope_block[SYNTH_BLOCK_SIZE];
+  // One chunk of every channel, before interleaving
+  float bus[SYNTH_CHANNELS_MAX][SYNTH_BLOCK_SIZE];
+  // Ring of each STRING voice, only the first string[v].delay frames
+  // are used
+  float string_line[VOICE_COUNT_MAX][WAVEGUIDE_FRAMES];
+} Synth;
+
+// Harmonic series of each instrument, matching the analytic kernels
+
+static void series_sine(unsigned int n, double* sine, double* cosine)
+{
+  *sine = (n == 1) ? 1.0 : 0.0;
+  *cosine = 0.0;
+}
+
+static void series_square(unsigned int n, double* sine, double* cosine)
+{
+  *sine = (n % 2) ? 4.0 / (SYNTH_PI * n) : 0.0;
+  *cosine = 0.0;
+}
+
+static void series_triangle(unsigned int n, double* sine, double* cosine)
+{
+  *sine = 0.0;
+  *cosine = (n % 2) ? 8.0 / (SYNTH_PI * SYNTH_PI * n * n) : 0.0;
+}
+
+static void series_saw(unsigned int n, double* sine, double* cosine)
+{
+  *sine = -2.0 / (SYNTH_PI * n);
+  *cosine = 0.0;
+}
+
+static const HarmonicSeries instrument_series[INSTRUMENT_COUNT] = {
+  [SINE]     = series_sine,
+  [SQUARE]   = series_square,
+  [TRIANGLE] = series_triangle,
+  [SAW]      = series_saw,
+};
+
+// Shared by every Synth, built by the first synth_init(). Instruments
+// without a series have no table.
+static Wavetable wavetables[INSTRUMENT_COUNT];
+static bool wavetables_ready = false;
+
+void synth_init(Synth* synth, double sample_rate)
+{
+  memset(synth, 0, sizeof(*synth));
+  simd_init();
+  if (!wavetables_ready)
+  {
+    for (unsigned int i = 0; i < INSTRUMENT_COUNT; ++i)
+      if (instrument_series[i])
+        wavetable_build(&wavetables[i], instrument_series[i]);
+    wavetables_ready = true;
+  }
+
+  synth->mode         = OSCILLATOR_WAVETABLE;
+  synth->sample_rate  = sample_rate;
+  synth->channels     = 1;
+  synth->master       = 1.0f;
+  memcpy(synth->envelopes, default_envelopes, sizeof(default_envelopes));
+
+  // Equal temperament with A4, note 69, at 440 Hz
+  tuning_equal(&synth->tuning);
+  tuning_update(&synth->tuning, 440.0 * pow(2, (TUNING_ROOT - 69) / 12.0),
+                sample_rate);
+  return;
+}
+
+// Play TUNING_ROOT at [root_frequency] Hz from the next note on
+void synth_tune(Synth* synth, double root_frequency)
+{
+  tuning_update(&synth->tuning, root_frequency, synth->sample_rate);
+  return;
+}
+
+// Use the scale of [scale] from the next note on, keeping the root
+// frequency
+void synth_set_scale(Synth* synth, const Tuning* scale)
+{
+  synth->tuning.degrees = scale->degrees;
+  memcpy(synth->tuning.ratio, scale->ratio, scale->degrees * sizeof(double));
+  synth_tune(synth, synth->tuning.root_frequency);
+  return;
+}
+
+// Place voice [v] between the two channels nearest to its pan
+// position, with constant power
+static void synth_pan_voice(Synth* synth, unsigned int v)
+{
+  float pan = synth->pan[v];
+  if (pan < -1.0f) pan = -1.0f;
+  if (pan > 1.0f) pan = 1.0f;
+  float position = (pan + 1.0f) * 0.5f * (synth->channels - 1);
+  unsigned int channel = (unsigned int) position;
+  if (channel >= synth->channels - 1 && channel > 0)
+    channel = synth->channels - 2;
+  float fraction = (synth->channels > 1) ? position - channel : 0.0f;
+  synth->channel[v]      = channel;
+  synth->channel_gain[v] = cosf(fraction * (float)(SYNTH_PI / 2));
+  synth->next_gain[v]    = (synth->channels > 1) ? sinf(fraction * (float)(SYNTH_PI / 2)) : 0.0f;
+  return;
+}
+
+// Render [channels] interleaved channels, 1 to SYNTH_CHANNELS_MAX
+void synth_set_channels(Synth* synth, unsigned int channels)
+{
+  if (channels < 1) channels = 1;
+  if (channels > SYNTH_CHANNELS_MAX) channels = SYNTH_CHANNELS_MAX;
+  synth->channels = channels;
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+    synth_pan_voice(synth, v);
+  return;
+}
+
+// Envelope change per frame to cover [distance] in [seconds]
+static float synth_envelope_step(const Synth* synth, float distance, float seconds)
+{
+  double frames = seconds * synth->sample_rate;
+  return distance / ((frames > 1.0) ? frames : 1.0);
+}
+
+// Pick the voice for a new note: a free one if any, otherwise steal
+// the quietest released voice, otherwise the oldest held one.
+static unsigned int synth_allocate_voice(const Synth* synth)
+{
+  unsigned int best = 0;
+  int best_released = 0;
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+  {
+    if (synth->stage[v] == VOICE_OFF)
+      return v;
+
+    int released = synth->stage[v] == VOICE_RELEASE;
+    if (released && !best_released)
+    {
+      best = v;
+      best_released = 1;
+    }
+    else if (released == best_released)
+    {
+      if (released ? synth->envelope[v] < synth->envelope[best]
+                   : synth->clock - synth->age[v] > synth->clock - synth->age[best])
+        best = v;
+    }
+  }
+  return best;
+}
+
+// Start playing MIDI [note], at the frequency of the tuning table,
+// at [pan] from -1 (first channel) to 1 (last channel). Pressing a
+// note that is already sounding retriggers the same voice.
+void synth_note_on(Synth* synth, int note, Instrument instrument,
+                   float amplitude, float pan)
+{
+  if (note < 0 || note >= TUNING_NOTES)
+    return;
+
+  unsigned int v = VOICE_COUNT_MAX;
+  for (unsigned int i = 0; i < VOICE_COUNT_MAX; ++i)
+  {
+    if (synth->stage[i] != VOICE_OFF && synth->note[i] == note)
+    {
+      v = i;
+      break;
+    }
+  }
+  // A string that is still sounding is struck again
+  bool ringing = v < VOICE_COUNT_MAX && synth->instrument[v] == STRING;
+  if (v == VOICE_COUNT_MAX)
+  {
+    v = synth_allocate_voice(synth);
+    synth->phase[v]    = 0;
+    synth->envelope[v] = 0.0f;
+  }
+
+  synth->note[v]       = note;
+  synth->instrument[v] = instrument;
+  synth->increment[v]  = synth->tuning.increment[note];
+  synth->amplitude[v]  = amplitude;
+  synth->pan[v]        = pan;
+  synth->stage[v]      = VOICE_ATTACK;
+  synth_pan_voice(synth, v);
+  if (instrument == STRING)
+    waveguide_strike(&synth->string[v], synth->string_line[v], synth->increment[v],
+                     synth->sample_rate, amplitude, ringing);
+
+  const Adsr* adsr = &synth->envelopes[instrument];
+  float sustain = (adsr->sustain < 1.0f) ? adsr->sustain : 1.0f;
+  synth->sustain[v]      = sustain;
+  synth->attack_step[v]  = synth_envelope_step(synth, 1.0f, adsr->attack);
+  synth->decay_step[v]   = synth_envelope_step(synth, 1.0f - sustain, adsr->decay);
+  synth->release_step[v] = synth_envelope_step(synth, 1.0f, adsr->release);
+  synth->age[v]        = synth->clock++;
+  return;
+}
+
+// Release every voice owned by [note]
+void synth_note_off(Synth* synth, int note)
+{
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+  {
+    if (synth->stage[v] != VOICE_OFF && synth->stage[v] != VOICE_RELEASE
+        && synth->note[v] == note)
+      synth->stage[v] = VOICE_RELEASE;
+  }
+  return;
+}
+
+unsigned int synth_active_voices(const Synth* synth)
+{
+  unsigned int count = 0;
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+    count += synth->stage[v] != VOICE_OFF;
+  return count;
+}
+
+// Oscillator kernels. Each one writes [frame_count] samples in [-1, 1]
+// to [output] and advances [osc]. The phase of every frame is computed
+// from the phase at the start of the block, so iterations do not
+// depend on each other and the compiler is free to vectorize them.
+
+void render_sine(float* restrict output, unsigned int frame_count,
+                 Oscillator* osc)
+{
+  sine_block(output, frame_count, osc->phase, osc->increment);
+  osc->phase += frame_count * osc->increment;
+  return;
+}
+
+// PolyBLEP residual: the difference between a band-limited and a
+// naive unit step, for a discontinuity at phase 0 reached with phase
+// increment [dt] (and [inv_dt] = 1 / dt). Non zero only within one
+// frame of the step. Both sides are computed and selected so that the
+// calling loops stay branch-free and vectorize.
+static inline float poly_blep(float t, float dt, float inv_dt)
+{
+  float x = t * inv_dt;
+  float y = (t - 1.0f) * inv_dt;
+  float before = x + x - x * x - 1.0f;
+  float after = y * y + y + y + 1.0f;
+  return (t < dt) ? before : ((t > 1.0f - dt) ? after : 0.0f);
+}
+
+// PolyBLAMP residual, the integral of poly_blep(), for a unit change
+// of slope at phase 0. Scaled by [dt] to be in phase units.
+static inline float poly_blamp(float t, float dt, float inv_dt)
+{
+  float x = t * inv_dt - 1.0f;
+  float y = (t - 1.0f) * inv_dt + 1.0f;
+  float before = -dt * x * x * x / 6.0f;
+  float after = dt * y * y * y / 6.0f;
+  return (t < dt) ? before : ((t > 1.0f - dt) ? after : 0.0f);
+}
+
+// Square, triangle and saw smooth their discontinuities with
+// PolyBLEP (steps) and PolyBLAMP (corners), which removes most of the
+// aliasing of the naive waveforms for a few extra operations per frame.
+// Half a turn later is the phase plus 2^31, wrapped for free.
+
+#define HALF_TURN 0x80000000u
+
+void render_square(float* restrict output, unsigned int frame_count,
+                   Oscillator* osc)
+{
+  const uint32_t phase = osc->phase;
+  const uint32_t increment = osc->increment;
+  const float dt = (float) increment * 0x1p-32f;
+  const float inv_dt = 1.0f / dt;
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    uint32_t p = phase + i * increment;
+    float naive = (p < HALF_TURN) ? 1.0f : -1.0f;
+    output[i] = naive + poly_blep(phase_to_float(p), dt, inv_dt)
+                      - poly_blep(phase_to_float(p + HALF_TURN), dt, inv_dt);
+  }
+  osc->phase = phase + frame_count * increment;
+  return;
+}
+
+void render_triangle(float* restrict output, unsigned int frame_count,
+                     Oscillator* osc)
+{
+  const uint32_t phase = osc->phase;
+  const uint32_t increment = osc->increment;
+  const float dt = (float) increment * 0x1p-32f;
+  const float inv_dt = 1.0f / dt;
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    uint32_t p = phase + i * increment;
+    float t = phase_to_float(p);
+    float naive = 4.0f * fabsf(t - 0.5f) - 1.0f;
+    // The slope goes from +4 to -4 at phase 0 and back at phase 0.5
+    output[i] = naive + 8.0f * (poly_blamp(phase_to_float(p + HALF_TURN), dt, inv_dt)
+                                - poly_blamp(t, dt, inv_dt));
+  }
+  osc->phase = phase + frame_count * increment;
+  return;
+}
+
+void render_saw(float* restrict output, unsigned int frame_count,
+                Oscillator* osc)
+{
+  const uint32_t phase = osc->phase;
+  const uint32_t increment = osc->increment;
+  const float dt = (float) increment * 0x1p-32f;
+  const float inv_dt = 1.0f / dt;
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    float t = phase_to_float(phase + i * increment);
+    output[i] = 2.0f * t - 1.0f - poly_blep(t, dt, inv_dt);
+  }
+  osc->phase = phase + frame_count * increment;
+  return;
+}
+
+typedef void (*OscillatorKernel)(float* restrict output,
+                                 unsigned int frame_count, Oscillator* osc);
+
+static const OscillatorKernel oscillator_kernels[INSTRUMENT_COUNT] = {
+  [SINE]     = render_sine,
+  [SQUARE]   = render_square,
+  [TRIANGLE] = render_triangle,
+  [SAW]      = render_saw,
+};
+
+// True if [instrument] is rendered by synth_oscillator()
+static inline bool instrument_oscillator(Instrument instrument)
+{
+  return oscillator_kernels[instrument] != NULL;
+}
+
+// Render one block of [instrument] with the oscillator mode of [synth]
+static inline void synth_oscillator(const Synth* synth, Instrument instrument,
+                                    float* restrict output,
+                                    unsigned int frame_count, Oscillator* osc)
+{
+  if (synth->mode == OSCILLATOR_ANALYTIC)
+  {
+    oscillator_kernels[instrument](output, frame_count, osc);
+    return;
+  }
+
+  const float* level = wavetable_level(&wavetables[instrument], osc->increment);
+  if (synth->mode == OSCILLATOR_WAVETABLE_CUBIC)
+    wavetable_render_cubic(output, frame_count, level, osc->phase, osc->increment);
+  else
+    wavetable_render_linear(output, frame_count, level, osc->phase, osc->increment);
+  osc->phase += frame_count * osc->increment;
+  return;
+}
+
+// Write up to [frame_count] frames of a linear segment going from
+// [*envelope] towards [target] by [step] per frame to [output], and
+// move [*envelope] along. Returns how many frames were written, fewer
+// than [frame_count] if the segment ends within the block, in which
+// case the last frame is exactly [target].
+static inline unsigned int envelope_segment(float* restrict output,
+                                            unsigned int frame_count,
+                                            float* envelope, float step,
+                                            float target)
+{
+  const float start = *envelope;
+  const float frames = (target - start) / step;
+  if (!(frames > 0.0f))         // already there, or no distance to cover
+  {
+    *envelope = target;
+    return 0;
+  }
+
+  unsigned int length = (frames < frame_count) ? (unsigned int) ceilf(frames) : frame_count;
+  for (unsigned int i = 0; i < length; ++i)
+    output[i] = start + (i + 1) * step;
+
+  if (frames <= length)
+  {
+    output[length - 1] = target;
+    *envelope = target;
+  }
+  else
+  {
+    *envelope = start + length * step;
+  }
+  return length;
+}
+
+// Write the next [frame_count] envelope values of voice [v] to
+// [output]. Returns how many frames the voice lasts, which is less
+// than [frame_count] if it dies out within the block.
+static unsigned int synth_envelope_block(Synth* synth, unsigned int v,
+                                         float* restrict output,
+                                         unsigned int frame_count)
+{
+  float envelope = synth->envelope[v];
+  unsigned int i = 0;
+  while (i < frame_count)
+  {
+    switch(synth->stage[v])
+    {
+    case VOICE_ATTACK:
+      i += envelope_segment(output + i, frame_count - i, &envelope,
+                            synth->attack_step[v], 1.0f);
+      if (envelope >= 1.0f)
+        synth->stage[v] = VOICE_DECAY;
+      break;
+    case VOICE_DECAY:
+      i += envelope_segment(output + i, frame_count - i, &envelope,
+                            -synth->decay_step[v], synth->sustain[v]);
+      if (envelope <= synth->sustain[v])
+        synth->stage[v] = (envelope > 0.0f) ? VOICE_SUSTAIN : VOICE_OFF;
+      break;
+    case VOICE_SUSTAIN:
+      for (; i < frame_count; ++i)
+        output[i] = envelope;
+      break;
+    case VOICE_RELEASE:
+      i += envelope_segment(output + i, frame_count - i, &envelope,
+                            -synth->release_step[v], 0.0f);
+      if (envelope <= 0.0f)
+        synth->stage[v] = VOICE_OFF;
+      break;
+    default:
+      synth->envelope[v] = 0.0f;
+      return i;
+    }
+  }
+  synth->envelope[v] = envelope;
+  return frame_count;
+}
+
+// Copy [frame_count] frames of the first [channels] buses to
+// [output], interleaved. Called with constant [channels] so each
+// case compiles to its own shuffle of whole vectors.
+static inline void synth_interleave_channels(float* restrict output,
+                                             const float (*bus)[SYNTH_BLOCK_SIZE],
+                                             unsigned int frame_count,
+                                             unsigned int channels)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+    for (unsigned int c = 0; c < channels; ++c)
+      output[i * channels + c] = bus[c][i];
+  return;
+}
+
+static void synth_interleave(float* restrict output,
+                             const float (*bus)[SYNTH_BLOCK_SIZE],
+                             unsigned int frame_count, unsigned int channels)
+{
+  switch(channels)
+  {
+  case 2:  synth_interleave_channels(output, bus, frame_count, 2); break;
+  case 4:  synth_interleave_channels(output, bus, frame_count, 4); break;
+  case 6:  synth_interleave_channels(output, bus, frame_count, 6); break;
+  case 8:  synth_interleave_channels(output, bus, frame_count, 8); break;
+  default: synth_interleave_channels(output, bus, frame_count, channels); break;
+  }
+  return;
+}
+
+// Mix [frame_count] frames of voice [v] into [output], or into the
+// buses if there is more than one channel. A voice without gain only
+// advances its phase and envelope, a string without gain is left as
+// it is. Returns false if it was not heard.
+static bool synth_render_voice(Synth* synth, unsigned int v,
+                               float* restrict output, unsigned int frame_count)
+{
+  float* restrict wave = synth->wave;
+  float* restrict envelope = synth->envelope_block;
+  const float amplitude = synth->amplitude[v] * synth->master;
+  if (amplitude == 0.0f)
+  {
+    synth->phase[v] += frame_count * synth->increment[v];
+    synth_envelope_block(synth, v, envelope, frame_count);
+    return false;
+  }
+
+  bool ringing = true;
+  if (synth->instrument[v] == STRING)
+  {
+    ringing = waveguide_render(&synth->string[v], synth->string_line[v], wave,
+                               frame_count);
+  }
+  else
+  {
+    Oscillator osc = { synth->phase[v], synth->increment[v] };
+    synth_oscillator(synth, synth->instrument[v], wave, frame_count, &osc);
+    synth->phase[v] = osc.phase;
+  }
+
+  unsigned int len = synth_envelope_block(synth, v, envelope, frame_count);
+  const float gain = amplitude * synth->channel_gain[v];
+  const float next_gain = amplitude * synth->next_gain[v];
+  float* restrict first = (synth->channels > 1) ? synth->bus[synth->channel[v]] : output;
+  if (next_gain == 0.0f)
+  {
+    for (unsigned int i = 0; i < len; ++i)
+      first[i] += gain * envelope[i] * wave[i];
+  }
+  else
+  {
+    float* restrict second = synth->bus[synth->channel[v] + 1];
+    for (unsigned int i = 0; i < len; ++i)
+    {
+      float sample = envelope[i] * wave[i];
+      first[i] += gain * sample;
+      second[i] += next_gain * sample;
+    }
+  }
+  if (!ringing)
+  {
+    synth->stage[v] = VOICE_OFF;
+    synth->envelope[v] = 0.0f;
+  }
+  return true;
+}
+
+// True if voice [v] is rendered by synth_render_packs()
+static inline bool synth_packed(const Synth* synth, unsigned int v)
+{
+  return synth->voice_parallel && synth->mode == OSCILLATOR_ANALYTIC
+    && synth->instrument[v] == SINE;
+}
+
+// If the envelope of voice [v] stays on one linear segment for the
+// next [frame_count] frames, moves it along as synth_envelope_block()
+// would, sets [*level] and [*slope] so that frame i is at
+// level + (i + 1) * slope and returns true.
+static bool synth_envelope_linear(Synth* synth, unsigned int v,
+                                  unsigned int frame_count,
+                                  float* level, float* slope)
+{
+  const float envelope = synth->envelope[v];
+  float step, target;
+  switch(synth->stage[v])
+  {
+  case VOICE_SUSTAIN:
+    *level = envelope;
+    *slope = 0.0f;
+    return true;
+  case VOICE_ATTACK:
+    step = synth->attack_step[v];
+    target = 1.0f;
+    break;
+  case VOICE_DECAY:
+    step = -synth->decay_step[v];
+    target = synth->sustain[v];
+    break;
+  case VOICE_RELEASE:
+    step = -synth->release_step[v];
+    target = 0.0f;
+    break;
+  default:
+    return false;
+  }
+  // The segment must go on past the block, see envelope_segment()
+  if (!((target - envelope) / step > frame_count))
+    return false;
+  *level = envelope;
+  *slope = step;
+  synth->envelope[v] = envelope + frame_count * step;
+  return true;
+}
+
+// Render [frame_count] frames of the packed voices of [synth] from
+// [first_voice] to before [last_voice] into
+// [output], or into the buses if there is more than one channel.
+// Voices are packed by their first channel so all the lanes of a pack
+// add to the same two buses, and padding lanes have no gain. Voices
+// without gain or whose envelope changes segment within the block are
+// rendered on their own. Returns false if no voice was heard.
+static bool synth_render_packs(Synth* synth, float* restrict output,
+                               unsigned int frame_count,
+                               unsigned int first_voice, unsigned int last_voice)
+{
+  const unsigned int lanes = sine_voices_lanes;
+  const unsigned int channels = synth->channels;
+  const unsigned int first_channels = (channels > 1) ? channels - 1 : 1;
+  uint32_t phase[SIMD_LANES_MAX], increment[SIMD_LANES_MAX];
+  float level[SIMD_LANES_MAX], slope[SIMD_LANES_MAX];
+  float next_level[SIMD_LANES_MAX], next_slope[SIMD_LANES_MAX];
+  bool audible = false;
+
+  for (unsigned int c = 0; c < first_channels; ++c)
+  {
+    unsigned int count = 0;
+    for (unsigned int v = first_voice; v <= last_voice; ++v)
+    {
+      if (v < last_voice)
+      {
+        if (synth->stage[v] == VOICE_OFF || !synth_packed(synth, v)
+            || synth->channel[v] != c)
+          continue;
+        const float amplitude = synth->amplitude[v] * synth->master;
+        float envelope, step;
+        if (amplitude == 0.0f
+            || !synth_envelope_linear(synth, v, frame_count, &envelope, &step))
+        {
+          audible |= synth_render_voice(synth, v, output, frame_count);
+          continue;
+        }
+
+        const float gain = amplitude * synth->channel_gain[v];
+        const float next_gain = amplitude * synth->next_gain[v];
+        phase[count]      = synth->phase[v];
+        increment[count]  = synth->increment[v];
+        level[count]      = gain * envelope;
+        slope[count]      = gain * step;
+        next_level[count] = next_gain * envelope;
+        next_slope[count] = next_gain * step;
+        synth->phase[v] += frame_count * synth->increment[v];
+        if (++count < lanes)
+          continue;
+      }
+      if (count == 0)
+        continue;
+
+      for (unsigned int l = count; l < lanes; ++l)
+      {
+        phase[l] = increment[l] = 0;
+        level[l] = slope[l] = next_level[l] = next_slope[l] = 0.0f;
+      }
+      float* first = (channels > 1) ? synth->bus[c] : output;
+      float* second = (channels > 1) ? synth->bus[c + 1] : NULL;
+      sine_voices(first, second, frame_count, phase, increment,
+                  level, slope, next_level, next_slope);
+      audible = true;
+      count = 0;
+    }
+  }
+  return audible;
+}
+
+// Copy voices [first] to before [last] of [src] to the same voices
+// of [dst], every field of the voice pool and the used part of the
+// rings of the strings
+void synth_copy_voices(Synth* dst, const Synth* src,
+                       unsigned int first, unsigned int last)
+{
+#define SYNTH_COPY(field) \
+  memcpy(dst->field + first, src->field + first, (last - first) * sizeof(src->field[0]))
+  SYNTH_COPY(note);
+  SYNTH_COPY(instrument);
+  SYNTH_COPY(phase);
+  SYNTH_COPY(increment);
+  SYNTH_COPY(amplitude);
+  SYNTH_COPY(pan);
+  SYNTH_COPY(channel);
+  SYNTH_COPY(channel_gain);
+  SYNTH_COPY(next_gain);
+  SYNTH_COPY(envelope);
+  SYNTH_COPY(stage);
+  SYNTH_COPY(attack_step);
+  SYNTH_COPY(decay_step);
+  SYNTH_COPY(sustain);
+  SYNTH_COPY(release_step);
+  SYNTH_COPY(age);
+  SYNTH_COPY(string);
+#undef SYNTH_COPY
+  for (unsigned int v = first; v < last; ++v)
+    if (dst->stage[v] != VOICE_OFF && dst->instrument[v] == STRING)
+      memcpy(dst->string_line[v], src->string_line[v],
+             dst->string[v].delay * sizeof(float));
+  return;
+}
+
+// Mix the active voices from [first_voice] to before [last_voice]
+// into [output], [frame_count] frames of [synth->channels]
+// interleaved samples. [output] is overwritten. Work is split in
+// chunks of SYNTH_BLOCK_SIZE frames so the scratch buffers stay in
+// cache.
+// Returns false if the block is silent: no voice is playing, or the
+// ones playing have no gain, in which case they only advance their
+// phase and envelope and [output] is just cleared.
+bool synth_render_voices(Synth* synth, float* output, unsigned int frame_count,
+                         unsigned int first_voice, unsigned int last_voice)
+{
+  const unsigned int channels = synth->channels;
+  memset(output, 0, frame_count * channels * sizeof(float));
+
+  unsigned int active = 0;
+  for (unsigned int v = first_voice; v < last_voice; ++v)
+    active += synth->stage[v] != VOICE_OFF;
+  if (active == 0)
+    return false;
+
+  bool audible = false;
+  for (unsigned int start = 0; start < frame_count; start += SYNTH_BLOCK_SIZE)
+  {
+    unsigned int n = frame_count - start;
+    if (n > SYNTH_BLOCK_SIZE) n = SYNTH_BLOCK_SIZE;
+    float* restrict out = output + start * channels;
+    if (channels > 1)
+      for (unsigned int c = 0; c < channels; ++c)
+        memset(synth->bus[c], 0, n * sizeof(float));
+
+    bool chunk_audible = false;
+    for (unsigned int v = first_voice; v < last_voice; ++v)
+    {
+      if (synth->stage[v] == VOICE_OFF || synth_packed(synth, v)) continue;
+      chunk_audible |= synth_render_voice(synth, v, out, n);
+    }
+    if (synth->voice_parallel)
+      chunk_audible |= synth_render_packs(synth, out, n, first_voice, last_voice);
+
+    if (channels > 1 && chunk_audible)
+      synth_interleave(out, (const float (*)[SYNTH_BLOCK_SIZE]) synth->bus, n, channels);
+    audible |= chunk_audible;
+  }
+  return audible;
+}
+
+// Mix all active voices into [output], see synth_render_voices()
+bool synth_render(Synth* synth, float* output, unsigned int frame_count)
+{
+  return synth_render_voices(synth, output, frame_count, 0, VOICE_COUNT_MAX);
+}
@@ -0,0 +1,157 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// timing.c
+// ========
+//
+// Load histogram of the audio callback in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// The callback measures how long it takes to render each block and
+// divides it by the duration of the block, the time it has before the
+// device runs out of audio. A load of 1 or more means the block was
+// late, and the device most likely played a gap. The device is not
+// asked whether it did, so the late callbacks are only an estimate of
+// the xruns. Loads are counted in a histogram with one bucket every
+// TIMING_BUCKET_WIDTH of the period.
+//
+// Only the audio thread writes the counters, so it can update them
+// with plain atomic stores; the UI thread reads them with atomic
+// loads whenever it wants. Counters read together may be one block
+// apart from each other, which does not matter for statistics.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TIMING_BUCKETS      40
+// Fraction of the period per bucket, the last one counts every
+// load from (TIMING_BUCKETS - 1) * TIMING_BUCKET_WIDTH up
+#define TIMING_BUCKET_WIDTH 0.05
+
+typedef struct {
+  uint64_t histogram[TIMING_BUCKETS];
+  uint64_t callbacks;
+  uint64_t late;              // callbacks with a load of 1 or more
+  uint64_t max_ns;            // longest callback
+  uint64_t max_period_ns;     // period of the longest callback
+  uint64_t frames;            // total frames rendered
+  uint64_t min_frames;        // smallest and largest block
+  uint64_t max_frames;
+  uint64_t first_ns;          // start of the first callback
+  uint64_t last_ns;           // start of the last callback
+} CallbackTiming;
+
+void timing_init(CallbackTiming* timing)
+{
+  memset(timing, 0, sizeof(*timing));
+  return;
+}
+
+// Audio thread only. Count a callback that rendered [frame_count]
+// frames at [sample_rate] from [start] to [end] nanoseconds. Empty
+// callbacks have no period and are not counted.
+void timing_record(CallbackTiming* timing, uint64_t start, uint64_t end,
+                   unsigned int frame_count, double sample_rate)
+{
+  if (frame_count == 0)
+    return;
+  uint64_t elapsed = end - start;
+  double period = frame_count * 1e9 / sample_rate;
+  double load = elapsed / period;
+
+  // Clamped before the conversion, which is undefined out of range
+  double index = load / TIMING_BUCKET_WIDTH;
+  unsigned int bucket = (index < TIMING_BUCKETS - 1) ? (unsigned int) index : TIMING_BUCKETS - 1;
+  __atomic_store_n(&timing->histogram[bucket], timing->histogram[bucket] + 1,
+                   __ATOMIC_RELAXED);
+  if (load >= 1.0)
+    __atomic_store_n(&timing->late, timing->late + 1, __ATOMIC_RELAXED);
+  if (elapsed > timing->max_ns)
+  {
+    __atomic_store_n(&timing->max_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_store_n(&timing->max_period_ns, (uint64_t) period, __ATOMIC_RELAXED);
+  }
+  if (timing->callbacks == 0 || frame_count < timing->min_frames)
+    __atomic_store_n(&timing->min_frames, frame_count, __ATOMIC_RELAXED);
+  if (frame_count > timing->max_frames)
+    __atomic_store_n(&timing->max_frames, frame_count, __ATOMIC_RELAXED);
+  if (timing->callbacks == 0)
+    __atomic_store_n(&timing->first_ns, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->last_ns, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->frames, timing->frames + frame_count, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->callbacks, timing->callbacks + 1, __ATOMIC_RELAXED);
+  return;
+}
+
+// Any thread. Copy the counters of [timing] to [snapshot].
+void timing_read(const CallbackTiming* timing, CallbackTiming* snapshot)
+{
+  for (unsigned int i = 0; i < TIMING_BUCKETS; ++i)
+    snapshot->histogram[i] = __atomic_load_n(&timing->histogram[i], __ATOMIC_RELAXED);
+  snapshot->callbacks     = __atomic_load_n(&timing->callbacks, __ATOMIC_RELAXED);
+  snapshot->late          = __atomic_load_n(&timing->late, __ATOMIC_RELAXED);
+  snapshot->max_ns        = __atomic_load_n(&timing->max_ns, __ATOMIC_RELAXED);
+  snapshot->max_period_ns = __atomic_load_n(&timing->max_period_ns, __ATOMIC_RELAXED);
+  snapshot->frames        = __atomic_load_n(&timing->frames, __ATOMIC_RELAXED);
+  snapshot->min_frames    = __atomic_load_n(&timing->min_frames, __ATOMIC_RELAXED);
+  snapshot->max_frames    = __atomic_load_n(&timing->max_frames, __ATOMIC_RELAXED);
+  snapshot->first_ns      = __atomic_load_n(&timing->first_ns, __ATOMIC_RELAXED);
+  snapshot->last_ns       = __atomic_load_n(&timing->last_ns, __ATOMIC_RELAXED);
+  return;
+}
+
+// Load below which a fraction [p] of the callbacks of [snapshot]
+// fall, rounded up to the end of its bucket
+double timing_percentile(const CallbackTiming* snapshot, double p)
+{
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < TIMING_BUCKETS; ++i)
+    total += snapshot->histogram[i];
+
+  uint64_t count = 0;
+  for (unsigned int i = 0; i < TIMING_BUCKETS; ++i)
+  {
+    count += snapshot->histogram[i];
+    if (count > 0 && count >= p * total)
+      return (i + 1) * TIMING_BUCKET_WIDTH;
+  }
+  return 0.0;
+}
+
+// Print the histogram of [snapshot] to [file]
+void timing_print(const CallbackTiming* snapshot, FILE* file)
+{
+  fprintf(file, "Callbacks: %llu, late (likely xruns): %llu, longest %.3f ms of a %.3f ms period\n",
+          (unsigned long long) snapshot->callbacks,
+          (unsigned long long) snapshot->late,
+          snapshot->max_ns / 1e6, snapshot->max_period_ns / 1e6);
+  if (snapshot->callbacks == 0)
+    return;
+
+  fprintf(file, "Frames per callback: %llu to %llu, %.1f on average",
+          (unsigned long long) snapshot->min_frames,
+          (unsigned long long) snapshot->max_frames,
+          (double) snapshot->frames / snapshot->callbacks);
+  if (snapshot->callbacks > 1)
+    fprintf(file, ", one every %.3f ms",
+            (snapshot->last_ns - snapshot->first_ns) / 1e6 / (snapshot->callbacks - 1));
+  fprintf(file, "\n");
+
+  fprintf(file, "Load (fraction of the period):\n");
+  for (unsigned int i = 0; i < TIMING_BUCKETS; ++i)
+  {
+    if (snapshot->histogram[i] == 0) continue;
+    double share = (double) snapshot->histogram[i] / snapshot->callbacks;
+    fprintf(file, "  %3.0f%%%s %6.2f%% ", i * TIMING_BUCKET_WIDTH * 100,
+            (i == TIMING_BUCKETS - 1) ? "+" : " ", share * 100);
+    for (unsigned int bar = 0; bar < share * 50; ++bar)
+      fputc('#', file);
+    fputc('\n', file);
+  }
+  return;
+}
@@ -0,0 +1,165 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// tuning.c
+// ========
+//
+// Tuning tables mapping MIDI notes to phase increments, in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// A tuning is a scale, the ratios of its degrees to the root note up
+// to the period (usually the octave, 2/1), repeated over the whole
+// range of notes. The root note TUNING_ROOT plays at a given frequency
+// and the frequency and phase increment of every note are computed
+// once, whenever the root frequency or the sample rate change, so
+// starting a note is a table lookup.
+//
+// Scales are twelve tone equal temperament, 5-limit just intonation
+// or read from a Scala file (.scl):
+//
+//     ! comment lines start with '!'
+//     description, one line
+//     number of degrees
+//     one pitch per line, the last one is the period:
+//     cents if it contains a '.', like 701.955
+//     otherwise a ratio, like 3/2, or an integer, like 2
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// MIDI notes
+#define TUNING_NOTES       128
+// Note of the first degree of the scale, middle C
+#define TUNING_ROOT        60
+#define TUNING_DEGREES_MAX 128
+
+typedef struct {
+  unsigned int degrees;                // notes per period
+  double ratio[TUNING_DEGREES_MAX];    // degrees 1 to [degrees], the last is the period
+  double root_frequency;               // Hz of TUNING_ROOT
+  double sample_rate;
+
+  // Filled by tuning_update()
+  double frequency[TUNING_NOTES];      // Hz
+  uint32_t increment[TUNING_NOTES];    // phase increment per frame
+} Tuning;
+
+void tuning_equal(Tuning* tuning)
+{
+  tuning->degrees = 12;
+  for (unsigned int i = 0; i < 12; ++i)
+    tuning->ratio[i] = pow(2, (i + 1) / 12.0);
+  return;
+}
+
+void tuning_just(Tuning* tuning)
+{
+  static const double ratios[12] = {
+    16.0/15, 9.0/8, 6.0/5, 5.0/4, 4.0/3, 45.0/32,
+    3.0/2, 8.0/5, 5.0/3, 9.0/5, 15.0/8, 2.0,
+  };
+  tuning->degrees = 12;
+  memcpy(tuning->ratio, ratios, sizeof(ratios));
+  return;
+}
+
+// Reads the next line of [file] that is not a comment into [line].
+// Returns false at the end of the file.
+static bool scala_line(FILE* file, char* line, int size)
+{
+  while (fgets(line, size, file))
+    if (line[0] != '!')
+      return true;
+  return false;
+}
+
+// Load the scale of the Scala file at [path]. Prints the first error
+// to stderr and returns false, leaving [tuning] unchanged.
+bool tuning_load_scala(Tuning* tuning, const char* path)
+{
+  FILE* file = fopen(path, "r");
+  if (!file)
+  {
+    fprintf(stderr, "Error opening scale %s\n", path);
+    return false;
+  }
+
+  char line[256];
+  int degrees = 0;
+  double ratio[TUNING_DEGREES_MAX];
+  if (!scala_line(file, line, sizeof(line))          // description
+      || !scala_line(file, line, sizeof(line))
+      || sscanf(line, "%d", &degrees) != 1
+      || degrees < 1 || degrees > TUNING_DEGREES_MAX)
+  {
+    fprintf(stderr, "%s: expected a description and 1 to %d degrees\n",
+            path, TUNING_DEGREES_MAX);
+    fclose(file);
+    return false;
+  }
+
+  for (int i = 0; i < degrees; ++i)
+  {
+    long numerator = 0, denominator = 1;
+    double cents = 0.0;
+    bool valid = scala_line(file, line, sizeof(line));
+    char* pitch = line + strspn(line, " \t");
+    if (valid && strchr(pitch, '.'))
+    {
+      valid = sscanf(pitch, "%lf", &cents) == 1;
+      ratio[i] = pow(2, cents / 1200.0);
+    }
+    else if (valid)
+    {
+      int fields = sscanf(pitch, "%ld/%ld", &numerator, &denominator);
+      valid = fields >= 1 && numerator > 0 && denominator > 0;
+      ratio[i] = (double) numerator / denominator;
+    }
+    if (!valid || ratio[i] <= 0.0)
+    {
+      fprintf(stderr, "%s: bad or missing pitch %d of %d\n", path, i + 1, degrees);
+      fclose(file);
+      return false;
+    }
+  }
+  fclose(file);
+
+  if (ratio[degrees - 1] <= 1.0)
+  {
+    fprintf(stderr, "%s: the period must be above 1/1\n", path);
+    return false;
+  }
+  tuning->degrees = degrees;
+  memcpy(tuning->ratio, ratio, degrees * sizeof(double));
+  return true;
+}
+
+// Recompute the table of [tuning] with TUNING_ROOT at
+// [root_frequency] Hz, for [sample_rate]
+void tuning_update(Tuning* tuning, double root_frequency, double sample_rate)
+{
+  const int degrees = tuning->degrees;
+  const double period = tuning->ratio[degrees - 1];
+  tuning->root_frequency = root_frequency;
+  tuning->sample_rate = sample_rate;
+
+  for (int note = 0; note < TUNING_NOTES; ++note)
+  {
+    int distance = note - TUNING_ROOT;
+    int periods = (distance >= 0) ? distance / degrees
+                                  : -((degrees - 1 - distance) / degrees);
+    int degree = distance - periods * degrees;
+    double ratio = (degree == 0) ? 1.0 : tuning->ratio[degree - 1];
+    tuning->frequency[note] = root_frequency * ratio * pow(period, periods);
+    tuning->increment[note] = phase_increment(tuning->frequency[note], sample_rate);
+  }
+  return;
+}
@@ -0,0 +1,200 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// waveguide.c
+// ===========
+//
+// Digital waveguide string in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// A string is a ring of frames that the wave travels around once per
+// period, Karplus-Strong style. Each frame read from the ring goes
+// through a loss filter and a fractional delay and is written back
+// in its place, so the ring holds exactly the integer part of the
+// period and a string only ever touches that many floats: 32 strings
+// of the middle octaves fit in a few tens of KB, far below L2.
+//
+// The loss filter is a symmetric three tap FIR, which delays every
+// frequency by exactly one frame. Its gain and coefficient are set at
+// note on so that the fundamental decays by 60 dB in a time that
+// shrinks with the pitch, and the highest frequencies in
+// WAVEGUIDE_HIGH_TIME. The rest of the period is a first order
+// allpass tuned to the exact phase delay at the fundamental, so the
+// pitch is that of the phase increment of the voice.
+//
+// The string is struck by a hammer: a raised cosine pulse whose
+// width shrinks as it hits harder, minus the same pulse reflected
+// from the strike point, which takes out the harmonics that have a
+// node there. Striking a string that is still sounding adds to it.
+//
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef WAVEGUIDE_PI
+#define WAVEGUIDE_PI 3.14159265358979323846264
+#endif
+
+// Longest ring, A0 fits up to 48 kHz. Lower notes go up by octaves.
+#define WAVEGUIDE_FRAMES         2048
+// Seconds to decay by 60 dB at WAVEGUIDE_TIME_FREQUENCY, and by the
+// square root of the frequency ratio at the other notes
+#define WAVEGUIDE_TIME           8.0
+#define WAVEGUIDE_TIME_FREQUENCY 110.0
+// Seconds to decay by 60 dB at Nyquist
+#define WAVEGUIDE_HIGH_TIME      0.2
+// Loop gain limit, the highest notes decay faster than they should
+#define WAVEGUIDE_GAIN_MAX       0.9999
+// Strike point, as a fraction of the string
+#define WAVEGUIDE_POSITION       (1.0 / 7)
+// Seconds the hammer touches the string, softest and hardest
+#define WAVEGUIDE_CONTACT_SOFT   0.002
+#define WAVEGUIDE_CONTACT_HARD   0.0005
+// RMS of the ring after a strike on a silent string
+#define WAVEGUIDE_LEVEL          0.25
+// The string is silent once a whole ring stays below this
+#define WAVEGUIDE_SILENCE        1e-5f
+
+typedef struct {
+  unsigned int delay;    // frames in the ring
+  unsigned int write;    // position of the next frame
+  unsigned int quiet;    // frames in a row below WAVEGUIDE_SILENCE
+  float gain;            // loss filter, gain
+  float damping;         // loss filter, outer taps
+  float allpass;         // fractional delay coefficient
+  float x1, x2;          // last two frames read from the ring
+  float h1, y1;          // last input and output of the allpass
+} Waveguide;
+
+// Hammer pulse of [width] frames at frame [k], minus its reflection
+// [offset] frames later
+static inline double waveguide_hammer(unsigned int k, unsigned int width,
+                                      unsigned int offset)
+{
+  double pulse = 0.0;
+  if (k < width)
+    pulse += 0.5 - 0.5 * cos(2 * WAVEGUIDE_PI * (k + 1) / (width + 1));
+  if (k >= offset && k - offset < width)
+    pulse -= 0.5 - 0.5 * cos(2 * WAVEGUIDE_PI * (k - offset + 1) / (width + 1));
+  return pulse;
+}
+
+// Tune [string] to phase [increment] per frame at [sample_rate] and
+// strike it with [hardness] from 0 to 1. [line] holds at least
+// WAVEGUIDE_FRAMES frames. Unless [ringing], or if the period changed,
+// the string starts from rest.
+void waveguide_strike(Waveguide* string, float* line, uint32_t increment,
+                      double sample_rate, float hardness, bool ringing)
+{
+  double period = 0x1p32 / (increment ? increment : 1);
+  while (period > WAVEGUIDE_FRAMES + 1.5)
+    period /= 2;
+  if (period < 2.5) period = 2.5;
+
+  // One frame goes in the loss filter, 0.5 to 1.5 in the allpass
+  unsigned int delay = (unsigned int) (period - 1.5);
+  const double fraction = period - 1 - delay;
+  const double w = 2 * WAVEGUIDE_PI / period;
+  string->allpass = (float) (sin(w * (1 - fraction) / 2) / sin(w * (1 + fraction) / 2));
+
+  // Loss per period at the fundamental and at Nyquist, and the filter
+  // g (u/2, 1 - u, u/2) that has them:
+  // g (1 - u (1 - cos w)) at the fundamental and g (1 - 2u) at Nyquist
+  const double frequency = sample_rate / period;
+  const double time = WAVEGUIDE_TIME * sqrt(WAVEGUIDE_TIME_FREQUENCY / frequency);
+  const double loss = pow(10.0, -3.0 * period / (time * sample_rate));
+  const double high_loss = pow(10.0, -3.0 * period / (WAVEGUIDE_HIGH_TIME * sample_rate));
+  const double ratio = loss / high_loss;
+  double u = (ratio - 1) / (2 * ratio - 1 + cos(w));
+  if (u > 0.49) u = 0.49;
+  double gain = high_loss / (1 - 2 * u);
+  if (gain > WAVEGUIDE_GAIN_MAX) gain = WAVEGUIDE_GAIN_MAX;
+  string->gain = (float) gain;
+  string->damping = (float) (u / 2);
+
+  if (!ringing || string->delay != delay)
+  {
+    string->delay = delay;
+    string->write = 0;
+    string->x1 = string->x2 = string->h1 = string->y1 = 0.0f;
+    memset(line, 0, delay * sizeof(float));
+  }
+  string->quiet = 0;
+
+  if (hardness < 0.0f) hardness = 0.0f;
+  if (hardness > 1.0f) hardness = 1.0f;
+  double contact = WAVEGUIDE_CONTACT_SOFT
+    + (WAVEGUIDE_CONTACT_HARD - WAVEGUIDE_CONTACT_SOFT) * hardness;
+  unsigned int width = (unsigned int) (contact * sample_rate);
+  if (width > delay / 2) width = delay / 2;
+  if (width < 2) width = 2;
+  unsigned int offset = (unsigned int) lround(period * WAVEGUIDE_POSITION);
+  if (offset < 1) offset = 1;
+
+  // Scaled as if the whole pulse fitted in the ring
+  const unsigned int length = offset + width;
+  double energy = 0.0;
+  for (unsigned int k = 0; k < length; ++k)
+  {
+    double pulse = waveguide_hammer(k, width, offset);
+    energy += pulse * pulse;
+  }
+  const double scale = WAVEGUIDE_LEVEL * sqrt(delay / energy);
+  for (unsigned int k = 0; k < length; ++k)
+    line[(string->write + k) % delay] += (float) (scale * waveguide_hammer(k, width, offset));
+  return;
+}
+
+// Write the next [frame_count] frames of [string] to [output].
+// Returns false once the string has been silent for a whole ring.
+bool waveguide_render(Waveguide* string, float* restrict line,
+                      float* restrict output, unsigned int frame_count)
+{
+  const unsigned int delay = string->delay;
+  const float gain = string->gain;
+  const float outer = gain * string->damping;
+  const float inner = gain * (1.0f - 2.0f * string->damping);
+  const float allpass = string->allpass;
+  float x1 = string->x1, x2 = string->x2, h1 = string->h1, y1 = string->y1;
+  unsigned int write = string->write;
+  float peak = 0.0f;
+
+  // In runs up to the end of the ring, so the loop has no wrap
+  for (unsigned int i = 0; i < frame_count; )
+  {
+    unsigned int run = delay - write;
+    if (run > frame_count - i) run = frame_count - i;
+    float* restrict frames = line + write;
+    float* restrict out = output + i;
+    for (unsigned int k = 0; k < run; ++k)
+    {
+      float x = frames[k];
+      float h = outer * (x + x2) + inner * x1;
+      // Only the last product depends on the previous frame
+      float y = (allpass * h + h1) - allpass * y1;
+      x2 = x1;
+      x1 = x;
+      h1 = h;
+      y1 = y;
+      frames[k] = y;
+      out[k] = y;
+      peak = fmaxf(peak, fabsf(y));
+    }
+    i += run;
+    write += run;
+    if (write == delay) write = 0;
+  }
+
+  string->x1 = x1;
+  string->x2 = x2;
+  string->h1 = h1;
+  string->y1 = y1;
+  string->write = write;
+  string->quiet = (peak < WAVEGUIDE_SILENCE) ? string->quiet + frame_count : 0;
+  return string->quiet < delay;
+}
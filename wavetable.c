@@ -0,0 +1,140 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// wavetable.c
+// ===========
+//
+// Mipmapped band-limited wavetables in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// A wavetable stores one period of a waveform at several levels, one
+// per octave. Level k is the sum of the first WAVETABLE_SIZE/2 >> k
+// harmonics of the waveform, so it can be played with a phase
+// increment of up to 2^k / WAVETABLE_SIZE without any harmonic going
+// above Nyquist. Tables are built once by additive synthesis and then
+// read with linear or cubic interpolation: the top WAVETABLE_BITS
+// bits of a 32 bit phase are the index of a sample and the rest is
+// the position between it and the next.
+//
+
+#include <math.h>
+#include <stdint.h>
+
+#ifndef WAVETABLE_PI
+#define WAVETABLE_PI 3.14159265358979323846264
+#endif
+
+// Samples per period
+#define WAVETABLE_BITS   11
+#define WAVETABLE_SIZE   (1 << WAVETABLE_BITS)
+// Bits of the phase between two samples
+#define WAVETABLE_FRACTION_BITS (32 - WAVETABLE_BITS)
+// Levels needed to go from WAVETABLE_SIZE/2 harmonics down to one
+#define WAVETABLE_LEVELS 11
+// One guard sample before the period and two after it, so that
+// cubic interpolation never needs to wrap, plus one for alignment
+#define WAVETABLE_STRIDE (WAVETABLE_SIZE + 4)
+
+typedef struct {
+  float data[WAVETABLE_LEVELS][WAVETABLE_STRIDE];
+} Wavetable;
+
+// Writes to [sine] and [cosine] the amplitudes of harmonic [n] >= 1
+typedef void (*HarmonicSeries)(unsigned int n, double* sine, double* cosine);
+
+// Fill every level of [table] with the harmonic series [series]
+void wavetable_build(Wavetable* table, HarmonicSeries series)
+{
+  static double sine[WAVETABLE_SIZE];
+  static double period[WAVETABLE_SIZE];
+  const unsigned int mask = WAVETABLE_SIZE - 1;
+
+  for (unsigned int i = 0; i < WAVETABLE_SIZE; ++i)
+  {
+    sine[i] = sin(2 * WAVETABLE_PI * i / WAVETABLE_SIZE);
+    period[i] = 0.0;
+  }
+
+  // Start from the level with a single harmonic and add the missing
+  // harmonics going down one level at a time
+  unsigned int harmonics = 0;
+  for (int level = WAVETABLE_LEVELS - 1; level >= 0; --level)
+  {
+    unsigned int level_harmonics = (WAVETABLE_SIZE / 2) >> level;
+    for (unsigned int n = harmonics + 1; n <= level_harmonics; ++n)
+    {
+      double a = 0.0, b = 0.0;
+      series(n, &a, &b);
+      if (a == 0.0 && b == 0.0) continue;
+      for (unsigned int i = 0; i < WAVETABLE_SIZE; ++i)
+        period[i] += a * sine[(n * i) & mask]
+                   + b * sine[(n * i + WAVETABLE_SIZE / 4) & mask];
+    }
+    harmonics = level_harmonics;
+
+    float* data = table->data[level];
+    for (unsigned int i = 0; i < WAVETABLE_STRIDE; ++i)
+      data[i] = period[(i + mask) & mask];
+  }
+  return;
+}
+
+// Level of [table] to play at [increment], the phase increment per frame
+static inline const float* wavetable_level(const Wavetable* table, uint32_t increment)
+{
+  int level = 0;
+  uint32_t limit = 1u << WAVETABLE_FRACTION_BITS;
+  while (level < WAVETABLE_LEVELS - 1 && increment > limit)
+  {
+    limit <<= 1;
+    ++level;
+  }
+  return table->data[level] + 1;
+}
+
+// Index of the sample at or before [phase] and the position from it
+// to the next one in [0, 1)
+#define WAVETABLE_INDEX(phase) ((int)((phase) >> WAVETABLE_FRACTION_BITS))
+#define WAVETABLE_FRACTION(phase) \
+  ((float)(int32_t)((phase) & ((1u << WAVETABLE_FRACTION_BITS) - 1)) \
+   * (1.0f / (1u << WAVETABLE_FRACTION_BITS)))
+
+// Writes [frame_count] samples of [level] starting at [phase], with
+// linear interpolation between the two nearest samples
+void wavetable_render_linear(float* restrict output, unsigned int frame_count,
+                             const float* restrict level,
+                             uint32_t phase, uint32_t increment)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    uint32_t position = phase + i * increment;
+    int index = WAVETABLE_INDEX(position);
+    float t = WAVETABLE_FRACTION(position);
+    output[i] = level[index] + t * (level[index + 1] - level[index]);
+  }
+  return;
+}
+
+// Same as wavetable_render_linear() with 4 point cubic Hermite
+// interpolation, slower but with a lower noise floor
+void wavetable_render_cubic(float* restrict output, unsigned int frame_count,
+                            const float* restrict level,
+                            uint32_t phase, uint32_t increment)
+{
+  for (unsigned int i = 0; i < frame_count; ++i)
+  {
+    uint32_t position = phase + i * increment;
+    int index = WAVETABLE_INDEX(position);
+    float t = WAVETABLE_FRACTION(position);
+    float y0 = level[index - 1], y1 = level[index];
+    float y2 = level[index + 1], y3 = level[index + 2];
+    float c1 = 0.5f * (y2 - y0);
+    float c2 = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+    float c3 = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+    output[i] = ((c3 * t + c2) * t + c1) * t + y1;
+  }
+  return;
+}
@@ -0,0 +1,493 @@
+//////////////////////////////////////////////////////////////////////
+// SPDX-License-Identifier: MIT
+//
+// workers.c
+// =========
+//
+// Pool of worker threads sharing the voices of the synth, in C99.
+//
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// License: MIT
+//
+// The audio thread splits the voice pool in chunks of
+// WORKER_CHUNK_VOICES voices and publishes a job for every block.
+// Workers, each pinned to its own core, spin for a while after their
+// last job and then sleep on a futex; a new job wakes them. Every
+// thread, the audio thread included, claims free chunks one at a time
+// with a compare-and-swap and renders them, so a busy or slow thread
+// simply ends up claiming fewer chunks.
+//
+// Before publishing a job the audio thread copies the voices of every
+// chunk to a slot of its own, and workers only ever touch the slot of
+// the chunk they claimed: they render its voices there and mark the
+// chunk done with a single release store. The audio thread then
+// copies the new voice state back to the synth and mixes the chunk.
+// When the audio thread runs out of chunks it waits for the ones
+// still being rendered, but not forever: a chunk that takes much
+// longer than the audio thread's own chunks is taken back and
+// rendered again by the audio thread from the synth, which no worker
+// writes, and the late worker's slot is left to it until it notices
+// and gives it back. Workers that do not wake up in time never claim
+// any chunk, and the block is rendered on the audio thread alone. The
+// audio thread never takes a lock, never sleeps and never waits for
+// a worker past its deadline.
+//
+// Chunk words carry the number of the job and the slot of the chunk,
+// so a worker that wakes up in the middle of a later job can not
+// claim or complete a chunk of an old one.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define WORKERS_MAX         15
+#define WORKER_CHUNK_VOICES SIMD_LANES_MAX
+#define WORKER_CHUNKS       ((VOICE_COUNT_MAX + WORKER_CHUNK_VOICES - 1) / WORKER_CHUNK_VOICES)
+// Frames rendered per job, longer blocks take several jobs
+#define WORKER_FRAMES_MAX   (SYNTH_BLOCK_SIZE * 4)
+// How long an idle worker spins before going to sleep
+#define WORKER_SPIN_NS      200000
+// How long the audio thread waits for a chunk of a worker, if it did
+// not render any chunk itself to compare with
+#define WORKER_STEAL_NS     50000
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// Chunk states, in the low bits of a chunk word, with the slot of the
+// chunk and the job number above them
+enum {
+  CHUNK_FREE = 0,
+  CHUNK_CLAIMED,     // by a worker, or the audio thread
+  CHUNK_DONE,        // the result is in the slot
+  CHUNK_TAKEN,       // back from a late worker
+};
+#define CHUNK_STATE_BITS 2
+#define CHUNK_SLOT_BITS  5
+#define CHUNK_JOB_SHIFT  (CHUNK_STATE_BITS + CHUNK_SLOT_BITS)
+#define CHUNK_WORD(job, slot, state) \
+  (((uint32_t)(job) << CHUNK_JOB_SHIFT) | ((uint32_t)(slot) << CHUNK_STATE_BITS) | (state))
+#define CHUNK_STATE(word) ((word) & ((1u << CHUNK_STATE_BITS) - 1))
+#define CHUNK_SLOT(word)  (((word) >> CHUNK_STATE_BITS) & ((1u << CHUNK_SLOT_BITS) - 1))
+#define CHUNK_JOB(word)   ((word) >> CHUNK_JOB_SHIFT)
+
+// One per chunk of a job, plus one per worker that may still hold the
+// slot of a chunk taken back from it
+#define WORKER_SLOTS (WORKER_CHUNKS + WORKERS_MAX)
+
+typedef struct WorkerPool WorkerPool;
+
+// The voices of one chunk, and what rendering them gave
+typedef struct {
+  uint32_t     busy;           // not free for a new chunk
+  unsigned int frame_count;
+  bool         audible;
+  float        chunk[WORKER_FRAMES_MAX * SYNTH_CHANNELS_MAX];
+  Synth        voices;
+} WorkerSlot;
+
+typedef struct {
+  WorkerPool*  pool;
+  pthread_t    thread;
+  unsigned int index;
+} Worker;
+
+struct WorkerPool {
+  uint32_t     chunk_count;    // of the published job
+  bool         running;
+
+  unsigned char pad0[CACHE_LINE_SIZE];
+  uint32_t     job;            // published job number, and futex word
+  uint32_t     sleepers;       // workers waiting on the futex
+  unsigned char pad1[CACHE_LINE_SIZE];
+  uint32_t     chunks[WORKER_CHUNKS];
+
+  unsigned int count;          // worker threads
+  Worker*      workers[WORKERS_MAX];
+  unsigned int slot_count;
+  WorkerSlot*  slots[WORKER_SLOTS];
+  unsigned int next_slot;      // where the search for a free one starts
+  float        chunk[WORKER_FRAMES_MAX * SYNTH_CHANNELS_MAX]; // audio thread's
+};
+
+static inline uint64_t worker_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static inline void worker_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+  return;
+}
+
+// Claim a free chunk of [job], starting the search at [start], and
+// write its claimed word to [word]. Returns WORKER_CHUNKS if there is
+// none left.
+static unsigned int worker_claim(WorkerPool* pool, uint32_t job, unsigned int start,
+                                 uint32_t* word)
+{
+  const uint32_t count = __atomic_load_n(&pool->chunk_count, __ATOMIC_RELAXED);
+  for (unsigned int k = 0; k < count; ++k)
+  {
+    unsigned int c = (start + k) % count;
+    uint32_t expected = __atomic_load_n(&pool->chunks[c], __ATOMIC_RELAXED);
+    if (CHUNK_JOB(expected) != job || CHUNK_STATE(expected) != CHUNK_FREE)
+      continue;
+    uint32_t claimed = expected | CHUNK_CLAIMED;
+    if (__atomic_compare_exchange_n(&pool->chunks[c], &expected, claimed, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+      *word = claimed;
+      return c;
+    }
+  }
+  return WORKER_CHUNKS;
+}
+
+static inline unsigned int worker_chunk_end(unsigned int c)
+{
+  unsigned int end = (c + 1) * WORKER_CHUNK_VOICES;
+  return (end < VOICE_COUNT_MAX) ? end : VOICE_COUNT_MAX;
+}
+
+// Render chunk [c], claimed as [word], in its slot and mark it done if
+// the audio thread did not take it back, otherwise give the slot back
+static void worker_render_chunk(Worker* worker, unsigned int c, uint32_t word)
+{
+  WorkerPool* pool = worker->pool;
+  WorkerSlot* slot = pool->slots[CHUNK_SLOT(word)];
+  slot->audible = synth_render_voices(&slot->voices, slot->chunk, slot->frame_count,
+                                      c * WORKER_CHUNK_VOICES, worker_chunk_end(c));
+
+  uint32_t expected = word;
+  if (!__atomic_compare_exchange_n(&pool->chunks[c], &expected,
+                                   CHUNK_WORD(CHUNK_JOB(word), CHUNK_SLOT(word), CHUNK_DONE), false,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+  return;
+}
+
+// Wait until the published job is not [seen] any more
+static void worker_wait(WorkerPool* pool, uint32_t seen)
+{
+  const uint64_t until = worker_now() + WORKER_SPIN_NS;
+  while (__atomic_load_n(&pool->job, __ATOMIC_ACQUIRE) == seen)
+  {
+    if (worker_now() < until)
+    {
+      worker_relax();
+      continue;
+    }
+#ifdef __linux__
+    __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->job, __ATOMIC_SEQ_CST) == seen)
+      syscall(SYS_futex, &pool->job, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+#else
+    struct timespec nap = { 0, WORKER_STEAL_NS };
+    nanosleep(&nap, NULL);
+#endif
+  }
+  return;
+}
+
+static void* worker_main(void* arg)
+{
+  Worker* worker = arg;
+  WorkerPool* pool = worker->pool;
+  uint32_t seen = 0;
+  while (1)
+  {
+    worker_wait(pool, seen);
+    seen = __atomic_load_n(&pool->job, __ATOMIC_ACQUIRE);
+    if (!__atomic_load_n(&pool->running, __ATOMIC_RELAXED))
+      break;
+
+    // Start at a different chunk on every thread to avoid contention
+    unsigned int start = worker->index + 1;
+    unsigned int c;
+    uint32_t word;
+    while ((c = worker_claim(pool, seen, start, &word)) < WORKER_CHUNKS)
+    {
+      worker_render_chunk(worker, c, word);
+      start = c + 1;
+    }
+  }
+  return NULL;
+}
+
+// Pin [thread] to core [core], where supported. Failing is harmless.
+static void worker_pin(pthread_t thread, unsigned int core)
+{
+#ifdef __linux__
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 1)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core % cores, &set);
+  pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+  (void) thread;
+  (void) core;
+#endif
+  return;
+}
+
+// Wake every worker for the job just published
+static void worker_pool_wake(WorkerPool* pool)
+{
+#ifdef __linux__
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0)
+    syscall(SYS_futex, &pool->job, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  (void) pool;
+#endif
+  return;
+}
+
+void worker_pool_destroy(WorkerPool* pool);
+
+// Start [count] worker threads, up to WORKERS_MAX, pinned to cores 1
+// to [count]. Returns NULL if [count] is 0 or on failure.
+WorkerPool* worker_pool_create(unsigned int count)
+{
+  if (count == 0)
+    return NULL;
+  if (count > WORKERS_MAX) count = WORKERS_MAX;
+
+  WorkerPool* pool = calloc(1, sizeof(WorkerPool));
+  if (!pool)
+    return NULL;
+  pool->running = true;
+  for (unsigned int i = 0; i < WORKER_CHUNKS + count; ++i)
+  {
+    pool->slots[i] = calloc(1, sizeof(WorkerSlot));
+    if (!pool->slots[i])
+    {
+      worker_pool_destroy(pool);
+      return NULL;
+    }
+    pool->slot_count++;
+  }
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    Worker* worker = calloc(1, sizeof(Worker));
+    if (!worker)
+    {
+      worker_pool_destroy(pool);
+      return NULL;
+    }
+    worker->pool = pool;
+    worker->index = i;
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+    {
+      free(worker);
+      worker_pool_destroy(pool);
+      return NULL;
+    }
+    worker_pin(worker->thread, i + 1);
+    pool->workers[pool->count++] = worker;
+  }
+  return pool;
+}
+
+// Stop and free the workers of [pool]. No job must be running.
+void worker_pool_destroy(WorkerPool* pool)
+{
+  if (!pool)
+    return;
+  __atomic_store_n(&pool->running, false, __ATOMIC_RELAXED);
+  __atomic_store_n(&pool->job, pool->job + 1, __ATOMIC_SEQ_CST);
+  worker_pool_wake(pool);
+  for (unsigned int i = 0; i < pool->count; ++i)
+  {
+    pthread_join(pool->workers[i]->thread, NULL);
+    free(pool->workers[i]);
+  }
+  for (unsigned int i = 0; i < pool->slot_count; ++i)
+    free(pool->slots[i]);
+  free(pool);
+  return;
+}
+
+// A slot that no worker holds, or WORKER_SLOTS if there is none
+static unsigned int worker_pool_free_slot(WorkerPool* pool)
+{
+  for (unsigned int k = 0; k < pool->slot_count; ++k)
+  {
+    unsigned int s = (pool->next_slot + k) % pool->slot_count;
+    if (!__atomic_load_n(&pool->slots[s]->busy, __ATOMIC_ACQUIRE))
+    {
+      pool->next_slot = s + 1;
+      return s;
+    }
+  }
+  return WORKER_SLOTS;
+}
+
+// Add the [samples] samples of [chunk] to [output]
+static inline void worker_mix(float* restrict output, const float* restrict chunk,
+                              unsigned int samples)
+{
+  for (unsigned int i = 0; i < samples; ++i)
+    output[i] += chunk[i];
+  return;
+}
+
+// One job of at most WORKER_FRAMES_MAX frames
+static bool worker_pool_job(WorkerPool* pool, Synth* synth, float* output,
+                            unsigned int frame_count)
+{
+  const unsigned int samples = frame_count * synth->channels;
+  uint32_t job = pool->job + 1;
+  if (job >> (32 - CHUNK_JOB_SHIFT)) job = 1;   // keep the words unique
+
+  // Only the chunks with an active voice are worth a job
+  unsigned int chunk_count = 0;
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+    if (synth->stage[v] != VOICE_OFF)
+      chunk_count = v / WORKER_CHUNK_VOICES + 1;
+
+  // Copy the voices of every chunk to a free slot. There are always
+  // enough: each worker holds at most one slot taken back from it.
+  unsigned int slot_of[WORKER_CHUNKS];
+  for (unsigned int c = 0; c < chunk_count; ++c)
+  {
+    unsigned int s = worker_pool_free_slot(pool);
+    if (s == WORKER_SLOTS)
+    {
+      for (unsigned int k = 0; k < c; ++k)
+        __atomic_store_n(&pool->slots[slot_of[k]]->busy, 0, __ATOMIC_RELAXED);
+      return synth_render(synth, output, frame_count);
+    }
+    WorkerSlot* slot = pool->slots[s];
+    slot_of[c] = s;
+    __atomic_store_n(&slot->busy, 1, __ATOMIC_RELAXED);
+    slot->frame_count = frame_count;
+    slot->voices.channels       = synth->channels;
+    slot->voices.master         = synth->master;
+    slot->voices.mode           = synth->mode;
+    slot->voices.voice_parallel = synth->voice_parallel;
+    synth_copy_voices(&slot->voices, synth, c * WORKER_CHUNK_VOICES, worker_chunk_end(c));
+  }
+
+  // A worker still busy with the previous job may read the count, but
+  // it can not claim a chunk of the new one before seeing [job]
+  __atomic_store_n(&pool->chunk_count, chunk_count, __ATOMIC_RELAXED);
+  for (unsigned int c = 0; c < chunk_count; ++c)
+    __atomic_store_n(&pool->chunks[c], CHUNK_WORD(job, slot_of[c], CHUNK_FREE),
+                     __ATOMIC_RELAXED);
+  __atomic_store_n(&pool->job, job, __ATOMIC_SEQ_CST);
+  worker_pool_wake(pool);
+
+  // Render chunks here too, from the synth, until there are none left
+  memset(output, 0, samples * sizeof(float));
+  bool audible = false;
+  uint64_t own_ns = 0;
+  unsigned int own_chunks = 0;
+  unsigned int c;
+  uint32_t word;
+  while ((c = worker_claim(pool, job, 0, &word)) < WORKER_CHUNKS)
+  {
+    uint64_t start = worker_now();
+    if (synth_render_voices(synth, pool->chunk, frame_count,
+                            c * WORKER_CHUNK_VOICES, worker_chunk_end(c)))
+    {
+      worker_mix(output, pool->chunk, samples);
+      audible = true;
+    }
+    __atomic_store_n(&pool->chunks[c], CHUNK_WORD(job, slot_of[c], CHUNK_TAKEN),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->slots[slot_of[c]]->busy, 0, __ATOMIC_RELAXED);
+    own_ns += worker_now() - start;
+    ++own_chunks;
+  }
+
+  // Collect the chunks of the workers, taking back the late ones. A
+  // worker only ever holds its chunk as claimed, which can be taken
+  // back at any time, so this waits at most until the deadline.
+  uint64_t patience = own_chunks ? 2 * own_ns / own_chunks + 1000 : WORKER_STEAL_NS;
+  uint64_t deadline = worker_now() + patience;
+  for (c = 0; c < chunk_count; ++c)
+  {
+    WorkerSlot* slot = pool->slots[slot_of[c]];
+    const unsigned int first = c * WORKER_CHUNK_VOICES, last = worker_chunk_end(c);
+    const uint32_t claimed = CHUNK_WORD(job, slot_of[c], CHUNK_CLAIMED);
+    while (1)
+    {
+      word = __atomic_load_n(&pool->chunks[c], __ATOMIC_ACQUIRE);
+      if (word == CHUNK_WORD(job, slot_of[c], CHUNK_DONE))
+      {
+        synth_copy_voices(synth, &slot->voices, first, last);
+        if (slot->audible)
+        {
+          worker_mix(output, slot->chunk, samples);
+          audible = true;
+        }
+        __atomic_store_n(&slot->busy, 0, __ATOMIC_RELAXED);
+        break;
+      }
+      if (word != claimed)      // rendered here
+        break;
+      if (worker_now() > deadline
+          && __atomic_compare_exchange_n(&pool->chunks[c], &word,
+                                         CHUNK_WORD(job, slot_of[c], CHUNK_TAKEN), false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        // The slot stays busy until the worker gives it back
+        if (synth_render_voices(synth, pool->chunk, frame_count, first, last))
+        {
+          worker_mix(output, pool->chunk, samples);
+          audible = true;
+        }
+        break;
+      }
+      worker_relax();
+    }
+  }
+  return audible;
+}
+
+// Audio thread only. Render like synth_render(), with the voices
+// shared between the audio thread and the workers of [pool]. Falls
+// back to synth_render() without a pool or with a single chunk of
+// voices to render.
+bool worker_pool_render(WorkerPool* pool, Synth* synth, float* output,
+                        unsigned int frame_count)
+{
+  unsigned int last_active = 0;
+  for (unsigned int v = 0; v < VOICE_COUNT_MAX; ++v)
+    if (synth->stage[v] != VOICE_OFF)
+      last_active = v + 1;
+  if (!pool || last_active <= WORKER_CHUNK_VOICES)
+    return synth_render(synth, output, frame_count);
+
+  bool audible = false;
+  for (unsigned int start = 0; start < frame_count; start += WORKER_FRAMES_MAX)
+  {
+    unsigned int n = frame_count - start;
+    if (n > WORKER_FRAMES_MAX) n = WORKER_FRAMES_MAX;
+    audible |= worker_pool_job(pool, synth, output + start * synth->channels, n);
+  }
+  return audible;
+}